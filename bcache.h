@@ -0,0 +1,17 @@
+// Classes of disk blocks, see bclass() in bio.c.
+#define BC_DATA    0   // File and directory contents, indirect blocks
+#define BC_INODE   1   // Inode blocks and the superblock
+#define BC_BITMAP  2   // Free block bitmap
+#define BC_LOG     3   // Log header and logged blocks
+#define NBCLASS    4
+
+struct bcachestat {
+  uint hits[NBCLASS];      // Lookups of blocks of each class already cached
+  uint misses[NBCLASS];    // Lookups that had to recycle a buffer
+  uint evictions[NBCLASS]; // Cached blocks of each class recycled
+  uint ghosthits;          // Misses on blocks evicted not long ago
+  uint readaheads;         // Blocks read ahead of sequential reads
+  uint nbuf;               // Buffers in the cache
+  uint nhot;               // Buffers with blocks used more than once
+  uint ncold;              // Buffers with blocks used once so far
+};
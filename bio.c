@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,79 +17,273 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Every buffer is in the bucket of its (dev, blockno), and each
+// bucket has its own lock, so looking up cached blocks on different
+// cpus rarely contends. Recycling a buffer for another block moves
+// it between buckets; bcache.lock lets a single cpu at a time do so.
+//
+// The buffer to recycle is picked by a clock over the ring of all
+// buffers, in the spirit of 2Q: blocks start out cold and become hot
+// when looked up again while cached. The hand recycles the first
+// unused cold buffer it finds, so blocks read once, like those of a
+// long sequential scan, go first. A hot buffer is left alone while
+// it was used since the hand last passed, and otherwise goes cold.
+// Recently evicted cold blocks are remembered, and come back hot
+// if they are read again soon.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "x86.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "bcache.h"
 
-struct {
+#define NBUCKET  509          // Hash buckets, a prime
+#define NGHOST   NBUF         // Evicted cold blocks remembered
+#define NODEV    0xFFFFFFFF   // Device of the buffers never used
+
+extern struct superblock sb;  // fs.c
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;           // Hash chain, through next
+} __attribute__((aligned(64)));
+
+struct ghost {
+  uint dev;
+  uint blockno;
+};
+
+// Statistics, counted by each cpu.
+struct bcachecpu {
+  uint hits[NBCLASS];
+  uint misses[NBCLASS];
+  uint evictions[NBCLASS];
+  uint ghosthits;
+  uint readaheads;
+} __attribute__((aligned(64)));
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;       // Held to recycle buffers
+  struct bucket buckets[NBUCKET];
+  struct buf *hand;           // Clock hand, on the ring through cnext
+  struct ghost ghosts[NGHOST];  // Evicted cold blocks, by hash
+  struct bcachecpu cpu[NCPU];
 } bcache;
 
+static uint
+hash(uint dev, uint blockno)
+{
+  return dev * 31 + blockno;
+}
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.buckets[hash(dev, blockno) % NBUCKET];
+}
+
+// Class of the block, from the layout of the file system.
+static uint
+bclass(uint blockno)
+{
+  if(blockno <= 1)
+    return BC_INODE;
+  if(blockno >= sb.logstart && blockno < sb.inodestart)
+    return BC_LOG;
+  if(blockno >= sb.inodestart && blockno < sb.bmapstart)
+    return BC_INODE;
+  if(blockno >= sb.bmapstart && blockno < sb.bmapstart + sb.size/BPB + 1)
+    return BC_BITMAP;
+  return BC_DATA;
+}
+
+// Allocates the buffers. Unused buffers hold blocks of NODEV,
+// so that every buffer is always in a bucket.
 void
 binit(void)
 {
+  struct kcache *cache;
+  struct bucket *bk;
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.buckets; bk < &bcache.buckets[NBUCKET]; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
-//PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(i = 0; i < NGHOST; i++)
+    bcache.ghosts[i].dev = NODEV;
+
+  cache = kcachecreate("buf", sizeof(struct buf), 0);
+  for(i = 0; i < NBUF; i++){
+    if((b = kcachealloc(cache)) == 0)
+      panic("binit: out of memory");
+    memset(b, 0, sizeof(*b));
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->dev = NODEV;
+    b->blockno = i;
+    bk = bhash(b->dev, b->blockno);
+    b->next = bk->head;
+    bk->head = b;
+    if(bcache.hand == 0)
+      b->cnext = b;
+    else {
+      b->cnext = bcache.hand->cnext;
+      bcache.hand->cnext = b;
+    }
+    bcache.hand = b;
   }
 }
 
+// Looks for the block in its bucket bk.
+// Called with bk->lock held.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+}
+
+// Finds an unused cold buffer with the clock, cooling down on the
+// way the hot ones not used since the hand last passed, and takes
+// it out of its bucket. Called with bcache.lock and the lock of
+// bucket bk held.
+static struct buf*
+bvictim(struct bucket *bk)
+{
+  struct bucket *vb;
+  struct ghost *g;
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < 3*NBUF; i++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    if(b->refcnt != 0 || (b->flags & B_DIRTY))
+      continue;
+    vb = bhash(b->dev, b->blockno);
+    if(vb != bk)
+      acquire(&vb->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      if(b->hot){
+        if(b->used)
+          b->used = 0;
+        else
+          b->hot = 0;
+      } else {
+        bunhash(vb, b);
+        if(b->dev != NODEV){
+          g = &bcache.ghosts[hash(b->dev, b->blockno) % NGHOST];
+          g->dev = b->dev;
+          g->blockno = b->blockno;
+          bcache.cpu[cpuid()].evictions[b->class]++;
+        }
+        if(vb != bk)
+          release(&vb->lock);
+        return b;
+      }
+    }
+    if(vb != bk)
+      release(&vb->lock);
+  }
+  panic("bget: no buffers");
+}
+
+// Returns 1 if the block was evicted cold not long ago,
+// and forgets it. Called with bcache.lock held.
+static int
+bghost(uint dev, uint blockno)
+{
+  struct ghost *g;
+
+  g = &bcache.ghosts[hash(dev, blockno) % NGHOST];
+  if(g->dev != dev || g->blockno != blockno)
+    return 0;
+  g->dev = NODEV;
+  return 1;
+}
+
+// Counts a lookup of the cached block of b. Blocks looked up
+// again become hot, but the first lookup of a block read ahead
+// is the one it was read for. Called with b's bucket locked.
+static void
+bref(struct buf *b)
+{
+  if(b->ahead)
+    b->ahead = 0;
+  else
+    b->hot = 1;
+  bcache.cpu[cpuid()].hits[b->class]++;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = blookup(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    bref(b);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-  panic("bget: no buffers");
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  // Another cpu may have cached it meanwhile.
+  if((b = blookup(bk, dev, blockno)) == 0){
+    b = bvictim(bk);
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->class = bclass(blockno);
+    b->used = 0;
+    b->ahead = 0;
+    b->hot = bghost(dev, blockno);
+    if(b->hot)
+      bcache.cpu[cpuid()].ghosthits++;
+    bcache.cpu[cpuid()].misses[b->class]++;
+    b->next = bk->head;
+    bk->head = b;
+  } else
+    bref(b);
+  b->refcnt++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +299,58 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading the indicated block in the background, unless it
+// is cached already. Nobody holds the buffer while it is read;
+// a bread() of the block waits in iderw() for the read to finish.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if(blookup(bk, dev, blockno)){
+    release(&bk->lock);
+    release(&bcache.lock);
+    return;
+  }
+  b = bvictim(bk);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = B_ASYNC;
+  b->class = bclass(blockno);
+  b->used = 0;
+  b->hot = 0;
+  b->ahead = 1;
+  b->refcnt = 1;  // Given back by breaddone()
+  b->next = bk->head;
+  bk->head = b;
+  bcache.cpu[cpuid()].readaheads++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  ideread(b);
+}
+
+// Called by ideintr() once a read ahead of b is done.
+void
+breaddone(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +361,135 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Start writing b's contents to disk, without waiting for it,
+// so that the disk can merge the writes of consecutive blocks.
+// Must be locked, and waited for with bwait() before brelse().
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  b->flags |= B_DIRTY;
+  iderwstart(b);
+}
+
+// Wait for the write started by bwritestart().
+void
+bwait(struct buf *b)
+{
+  iderwwait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Mark it used, so that the clock leaves it for a while.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b cannot change buckets while referenced.
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->used = 1;
+  }
+  release(&bk->lock);
+}
+
+// Copies the statistics of the buffer cache to st.
+void
+bcachestat(struct bcachestat *st)
+{
+  struct bcachecpu *c;
+  struct buf *b;
+  uint nbuf, nhot, ncold;
+  int i, k;
+
+  memset(st, 0, sizeof(*st));
+  for(i = 0; i < NCPU; i++){
+    c = &bcache.cpu[i];
+    for(k = 0; k < NBCLASS; k++){
+      st->hits[k] += c->hits[k];
+      st->misses[k] += c->misses[k];
+      st->evictions[k] += c->evictions[k];
+    }
+    st->ghosthits += c->ghosthits;
+    st->readaheads += c->readaheads;
   }
-  
+
+  nbuf = nhot = ncold = 0;
+  acquire(&bcache.lock);
+  b = bcache.hand;
+  do {
+    nbuf++;
+    if(b->dev != NODEV){
+      if(b->hot)
+        nhot++;
+      else
+        ncold++;
+    }
+    b = b->cnext;
+  } while(b != bcache.hand);
   release(&bcache.lock);
+  st->nbuf = nbuf;
+  st->nhot = nhot;
+  st->ncold = ncold;
 }
+
+#ifdef KTEST
+// Boot time benchmark of buffer lookups, run by main() in kernels
+// built with "make KTEST=1": the hash table against a walk of all
+// the buffers, like bget() did before the buffers were hashed.
+void
+bcachetest(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  uint64 t;
+  uint i, blockno, found;
+
+  // All the buffers are still unused, blocks of NODEV.
+  found = 0;
+  t = rdtsc();
+  for(i = 0; i < 10000; i++){
+    blockno = (i * 7919) % NBUF;
+    bk = bhash(NODEV, blockno);
+    acquire(&bk->lock);
+    if(blookup(bk, NODEV, blockno))
+      found++;
+    release(&bk->lock);
+  }
+  cprintf("bcachetest: %d buffers: hash: %d cycles per lookup\n",
+          NBUF, (uint)(rdtsc() - t) / 10000);
+
+  t = rdtsc();
+  for(i = 0; i < 10000; i++){
+    blockno = (i * 7919) % NBUF;
+    acquire(&bcache.lock);
+    b = bcache.hand;
+    do {
+      if(b->dev == NODEV && b->blockno == blockno){
+        found++;
+        break;
+      }
+      b = b->cnext;
+    } while(b != bcache.hand);
+    release(&bcache.lock);
+  }
+  cprintf("bcachetest: %d buffers: list walk: %d cycles per lookup\n",
+          NBUF, (uint)(rdtsc() - t) / 10000);
+  if(found != 20000)
+    panic("bcachetest: lost buffers");
+}
+#endif
+
 //PAGEBREAK!
 // Blank page.
 
@@ -4,11 +4,16 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint class;        // BC_* class of the block, for the statistics
+  uint hot;          // looked up again since cached
+  uint ahead;        // read ahead, not looked up yet
+  uint used;         // referenced since the clock last passed
+  struct buf *next;  // hash bucket
+  struct buf *cnext; // ring of all buffers, for the clock
   struct buf *qnext; // disk queue
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // buffer is being read ahead, see breadahead()
 
@@ -1,20 +1,33 @@
+struct bcachestat;
 struct buf;
 struct context;
+struct faultstat;
 struct file;
 struct inode;
+struct kcache;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct slabstat;
+struct runqueue;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trapframe;
+struct vmmap;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadahead(uint, uint);
+void            breaddone(struct buf*);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            bcachetest(void);
+void            bcachestat(struct bcachestat*);
 
 // console.c
 void            consoleinit(void);
@@ -40,6 +53,8 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iexecdup(struct inode*);
+void            iexecput(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -57,6 +72,9 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwstart(struct buf*);
+void            iderwwait(struct buf*);
+void            ideread(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,22 +83,31 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
+char*           kalloc_order(int);
+void            kfree_order(char*, int);
+void            kalloctest(void);
+int             kzerofill(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 void            incref(char *v);
-void            decref(char *v);
+int             decref(char *v);
 int             refcount(char *v);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
+extern uint     lapictick;
+extern uint64   tsctick;
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
+void            lapictimer(uint);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
@@ -98,7 +125,13 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pci.c
+uint            pciread(int, int);
+void            pciwrite(int, int, uint);
+int             pcifind(int, int);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -122,14 +155,20 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeup_one(void*);
+void            wakeupproc(struct proc*, void*);
 void            yield(void);
 int             procstat(void);
 void            increasepriority(struct proc *p);
 void            decreasepriority(struct proc *p);
 void            plevelstat(void);
 int             nice(int inc);
+int             idleticks(int cpu);
+int             faultstat(int, struct faultstat*);
+int             cpuload(void);
 void            aging(void);
-void            printlevel(int level);
+void            rebalance(void);
+void            printlevel(struct runqueue *rq, int level);
 
 // semaphore.c
 int             semget(int key, int init_value);
@@ -138,6 +177,35 @@ int             semdown(int key);
 int             semup(int key);
 void            seminit(void);
 void            semcopy(struct proc *, struct proc *);
+// mmap.c
+void            mmapinit(void);
+char*           filepage(struct inode*, uint);
+void            mmapinval(struct inode*);
+struct vmmap*   mmapfind(struct proc*, uint);
+int             mmaprange(struct proc*, uint, uint);
+int             mmapwritable(struct proc*, uint);
+int             mmap(struct file*, uint, int, int);
+int             munmap(uint);
+int             mmapcopy(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+
+// shm.c
+void            shminit(void);
+int             shmget(int, int);
+int             shmat(int);
+int             shmdt(uint);
+int             shmrange(struct proc*, uint, uint);
+int             shmcopy(struct proc*, struct proc*);
+void            shmexec(struct proc*);
+void            shmexit(struct proc*);
+
+// slab.c
+void            slabinit(void);
+struct kcache*  kcachecreate(char*, uint, void (*)(void*));
+void*           kcachealloc(struct kcache*);
+void            kcachefree(struct kcache*, void*);
+int             slabstat(struct slabstat*, int);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -168,6 +236,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argoutptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -177,8 +246,13 @@ void            syscall(void);
 void            timerinit(void);
 
 // trap.c
+void            clockupdate(void);
 void            idtinit(void);
+extern uint     nextwakeup;
 extern uint     ticks;
+void            timerarm(void);
+void            timeradd(struct proc*, uint);
+void            timerdel(struct proc*);
 void            tvinit(void);
 extern struct spinlock tickslock;
 
@@ -196,14 +270,17 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 pde_t*          cowuvm(pde_t*, uint);
-void            handlepgflt(void);
+int             mappages(pde_t*, void*, uint, uint, int);
+int             shareuvm(pde_t*, pde_t*, uint, uint);
+void            flushtlb(void);
+int             handlepgflt(struct trapframe*);
+int             touchuvm(uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
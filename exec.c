@@ -11,11 +11,12 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe, *oldexe;
   struct proghdr ph;
+  struct vmseg seg[NVMSEG];
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
@@ -28,6 +29,7 @@ exec(char *path, char **argv)
   }
   ilock(ip);
   pgdir = 0;
+  exe = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,8 +40,10 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Only record where the program goes in memory. The pages
+  // are read from ip the first time they are touched.
   sz = 0;
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -49,13 +53,20 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz >= MMAPBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg == NVMSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
+  // Keep a reference to read the pages from.
+  exe = iexecdup(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
@@ -95,12 +106,23 @@ exec(char *path, char **argv)
 
   // Commit to the user image.
   oldpgdir = curproc->pgdir;
+  oldexe = curproc->exe;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
+  curproc->exe = exe;
+  memmove(curproc->seg, seg, sizeof(seg));
+  curproc->nseg = nseg;
+  shmexec(curproc);
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
   freevm(oldpgdir);
+  mmapexit(curproc);
+  if(oldexe){
+    begin_op();
+    iexecput(oldexe);
+    end_op();
+  }
   return 0;
 
  bad:
@@ -110,5 +132,10 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iexecput(exe);
+    end_op();
+  }
   return -1;
 }
@@ -11,15 +11,31 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache, so there can be as
+// many open files as fit in memory. The lock protects the
+// reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kcache *cache;
 } ftable;
 
+// Files are returned to the cache closed, as fileclose()
+// leaves them, so this is only done once per object.
+static void
+filector(void *p)
+{
+  struct file *f = p;
+
+  f->type = FD_NONE;
+  f->ref = 0;
+}
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kcachecreate("file", sizeof(struct file), filector);
 }
 
 // Allocate a file structure.
@@ -28,16 +44,10 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcachealloc(ftable.cache)) == 0)
+    return 0;
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,6 +79,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kcachefree(ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
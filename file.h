@@ -14,8 +14,11 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // Processes running it (see iexecdup())
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint nextoff;       // where a sequential read would start
+  uint ranext;        // blocks before this one are read ahead
 
   short type;         // copy of disk inode
   short major;
@@ -267,6 +267,8 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->nextoff = 0;
+  ip->ranext = 0;
   release(&icache.lock);
 
   return ip;
@@ -283,6 +285,31 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Like idup, for a process that runs ip: its pages are read
+// from ip when first touched (see pagein() in vm.c), so ip
+// must not change meanwhile. writei() refuses to write to
+// it until every such reference is dropped with iexecput().
+struct inode*
+iexecdup(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->ref++;
+  ip->nexec++;
+  release(&icache.lock);
+  return ip;
+}
+
+// Drop a reference taken with iexecdup().
+// All calls to iexecput() must be inside a transaction.
+void
+iexecput(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->nexec--;
+  release(&icache.lock);
+  iput(ip);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -433,6 +460,7 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  mmapinval(ip);
 }
 
 // Copy stat information from inode.
@@ -447,6 +475,24 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading blocks first to last of ip in the background,
+// except those read ahead already. Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, nblocks;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  if(last >= nblocks)
+    last = nblocks - 1;
+  if(first < ip->ranext)
+    first = ip->ranext;
+  for(bn = first; bn <= last; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  if(last + 1 > ip->ranext)
+    ip->ranext = last + 1;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -467,6 +513,14 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // A read that starts where the last one ended is sequential:
+  // queue its blocks and the next ones before waiting for any.
+  if(n > 0 && off == ip->nextoff)
+    readahead(ip, off/BSIZE, (off + n - 1)/BSIZE + NREADAHEAD);
+  else
+    ip->ranext = 0;
+  ip->nextoff = off + n;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -479,6 +533,7 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
+// Fails if some process is running ip.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
@@ -491,6 +546,9 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return devsw[ip->major].write(ip, src, n);
   }
 
+  if(ip->nexec > 0)
+    return -1;
+
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
@@ -508,6 +566,8 @@ writei(struct inode *ip, char *src, uint off, uint n)
     ip->size = off;
     iupdate(ip);
   }
+  if(n > 0)
+    mmapinval(ip);
   return n;
 }
 
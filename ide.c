@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code. Transfers use bus master DMA when the PCI
+// IDE controller supports it, and programmed I/O otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +13,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +25,61 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Bus master IDE registers of the primary channel.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4     // Physical address of the PRD table
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08  // Transfer from the disk to memory
+#define BM_ST_ERR     0x02
+#define BM_ST_INTR    0x04
+
+// Physical region descriptor: a part of memory to transfer.
+// A table of them describes the memory of a DMA command.
+struct prd {
+  uint addr;
+  ushort count;             // Bytes
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // Last descriptor of the table
+
+#define IDE_MULT      16   // Sectors per interrupt of RDMUL/WRMUL
+#define IDE_MAXSECT   256  // Sectors of a command at most
+
+// Requests wait in two lists sorted by block number, linked
+// through qnext: those ahead of the disk head, served in this
+// sweep, and those behind it, served in the next one (C-SCAN).
+// Each list keeps its tail, so that requests arriving in order,
+// as sequential ones do, are appended in constant time.
+//
+// idestart() takes the first request of the sweep together with
+// the following ones for the next blocks, in the same direction,
+// and transfers them with a single command. active points to
+// the first buf of that command, and xfer to the next one whose
+// data is to be transferred.
+// You must hold idelock while manipulating the queue.
+
+struct bufq {
+  struct buf *head;
+  struct buf *tail;
+};
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct bufq sweep;     // Requests ahead of the head
+static struct bufq nextsweep; // Requests behind the head
+static struct buf *active;
+static struct buf *xfer;
+static uint headpos;          // Block after the last one requested
+static int multbufs;          // Bufs transferred per interrupt
+static ushort bmbase;         // Bus master registers, 0 for PIO
+static struct prd *prdt;      // PRD table of the active command
 
 static int havedisk1;
-static void idestart(struct buf*);
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,14 +94,48 @@ idewait(int checkerr)
   return 0;
 }
 
+// Ask the selected disk to transfer IDE_MULT sectors per interrupt.
+// Returns -1 if it cannot.
+static int
+idesetmult(void)
+{
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  return idewait(1);
+}
+
+// Look for a bus master IDE controller on the PCI bus,
+// and enable it. Without one, transfers are done by PIO.
+static void
+idedmainit(void)
+{
+  int tag;
+  uint bar;
+
+  if((tag = pcifind(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE)) < 0)
+    return;
+  // Bit 7 of the programming interface: bus master capable.
+  if(!(pciread(tag, PCI_CLASS) & 0x8000))
+    return;
+  bar = pciread(tag, PCI_BAR(4));
+  if(!(bar & 1))
+    return;
+  if((prdt = (struct prd*)kalloc()) == 0)
+    return;
+  pciwrite(tag, PCI_COMMAND,
+           pciread(tag, PCI_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+  bmbase = bar & 0xFFFC;
+}
+
 void
 ideinit(void)
 {
-  int i;
+  int i, ok;
 
   initlock(&idelock, "ide");
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
+  ok = idesetmult() == 0;
 
   // Check if disk 1 is present
   outb(0x1f6, 0xe0 | (1<<4));
@@ -64,36 +145,133 @@ ideinit(void)
       break;
     }
   }
+  if(havedisk1 && idesetmult() < 0)
+    ok = 0;
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  // Without multiple mode, READ and WRITE interrupt every sector.
+  multbufs = (ok ? IDE_MULT : 1) / (BSIZE/SECTOR_SIZE);
+  if(multbufs == 0)
+    multbufs = 1;
+
+  idedmainit();
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Insert b in q, keeping it sorted by block number.
 static void
-idestart(struct buf *b)
+bufqinsert(struct bufq *q, struct buf *b)
 {
-  if(b == 0)
-    panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+  struct buf **pp;
+
+  if(q->head == 0 || b->blockno >= q->tail->blockno){
+    b->qnext = 0;
+    if(q->head == 0)
+      q->head = b;
+    else
+      q->tail->qnext = b;
+    q->tail = b;
+    return;
+  }
+  for(pp=&q->head; (*pp)->blockno < b->blockno; pp=&(*pp)->qnext)  //DOC:insert-queue
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Transfer the data of the next block of sectors of the active
+// command, at most multbufs bufs, from or to the disk.
+static void
+idexfer(void)
+{
+  int i;
+
+  for(i = 0; i < multbufs && xfer; i++, xfer = xfer->qnext){
+    if(xfer->flags & B_DIRTY)
+      outsl(0x1f0, xfer->data, BSIZE/4);
+    else
+      insl(0x1f0, xfer->data, BSIZE/4);
+  }
+}
+
+// Point the bus master at the bufs from b on, and set
+// the direction of the transfer.
+static void
+idedmaprep(struct buf *b, int write)
+{
+  int i;
+
+  for(i = 0; b; b = b->qnext, i++){
+    prdt[i].addr = V2P(b->data);
+    prdt[i].count = BSIZE;
+    prdt[i].flags = 0;
+  }
+  prdt[i-1].flags = PRD_EOT;
+  outl(bmbase + BM_PRDT, V2P(prdt));
+  outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+  outb(bmbase + BM_CMD, write ? 0 : BM_CMD_READ);
+}
+
+// Start the next request, merged with the ones for the
+// following blocks.  Caller must hold idelock.
+static void
+idestart(void)
+{
+  struct buf *b, *last;
+  int n, write;
+
+  if(sweep.head == 0){
+    sweep = nextsweep;
+    nextsweep.head = nextsweep.tail = 0;
+  }
+  if((b = sweep.head) == 0)
+    return;
+
   int sector_per_block =  BSIZE/SECTOR_SIZE;
+  if (sector_per_block > 7) panic("idestart");
+
+  // Take the requests for the blocks right after b.
+  write = b->flags & B_DIRTY;
+  last = b;
+  for(n = 1; (n+1)*sector_per_block <= IDE_MAXSECT; n++){
+    if(last->qnext == 0 || last->qnext->dev != b->dev ||
+       last->qnext->blockno != last->blockno + 1 ||
+       (last->qnext->flags & B_DIRTY) != write)
+      break;
+    last = last->qnext;
+  }
+  sweep.head = last->qnext;
+  if(sweep.head == 0)
+    sweep.tail = 0;
+  last->qnext = 0;
+  active = xfer = b;
+  headpos = last->blockno + 1;
+
+  if(last->blockno >= FSSIZE)
+    panic("incorrect blockno");
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int multi = multbufs * sector_per_block > 1;
+  int read_cmd = multi ? IDE_CMD_RDMUL : IDE_CMD_READ;
+  int write_cmd = multi ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
 
-  if (sector_per_block > 7) panic("idestart");
+  if(bmbase)
+    idedmaprep(b, write);
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, (n*sector_per_block) & 0xff);  // number of sectors, 0 is 256
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(bmbase){
+    outb(0x1f7, write ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(bmbase + BM_CMD, inb(bmbase + BM_CMD) | BM_CMD_START);
+    xfer = 0;
+  } else if(write){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    idexfer();
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -103,66 +281,127 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(active == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(bmbase){
+    // The whole command is done: stop the bus master,
+    // and read the disk status to acknowledge it.
+    outb(bmbase + BM_CMD, 0);
+    outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+    idewait(1);
+  } else if(!(active->flags & B_DIRTY)){
+    // Read the block of sectors that is ready.
+    if(idewait(1) < 0)
+      xfer = 0;
+    else
+      idexfer();
+  } else if(xfer){
+    // The disk took the last block; send the next one.
+    idewait(0);
+    idexfer();
+    release(&idelock);
+    return;
+  }
+  if(xfer){
+    release(&idelock);
+    return;
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // The command is done. Wake the processes waiting for its bufs.
+  for(b = active; b; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      breaddone(b);
+    }
+  }
+  active = 0;
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Start disk on next request.
+  idestart();
 
   release(&idelock);
 }
 
+// Queue b for the disk, and start the disk if it was idle.
+// Caller must hold idelock.
+static void
+idequeueadd(struct buf *b)
+{
+  if(b->blockno >= headpos)
+    bufqinsert(&sweep, b);
+  else
+    bufqinsert(&nextsweep, b);
+
+  // Start disk if necessary.
+  if(active == 0)
+    idestart();
+}
+
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Queue b to be synced with disk, without waiting for it.
+// The caller must wait with iderwwait() before releasing b.
 void
-iderw(struct buf *b)
+iderwstart(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
   if(b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  // A read ahead may have read b since the caller looked.
+  if((b->flags & (B_VALID|B_DIRTY)) != B_VALID && !(b->flags & B_ASYNC))
+    idequeueadd(b);
 
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Wait for the request for b to finish.
+void
+iderwwait(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
+  release(&idelock);
+}
 
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If b is being read ahead, just wait for that read.
+void
+iderw(struct buf *b)
+{
+  iderwstart(b);
+  iderwwait(b);
+}
+
+// Queue a read of b and return without waiting for it.
+// b must have B_ASYNC set and a reference for the read,
+// which ideintr() gives back with breaddone().
+void
+ideread(struct buf *b)
+{
+  if(!(b->flags & B_ASYNC))
+    panic("ideread");
+  if(b->dev != 0 && !havedisk1)
+    panic("ideread: ide disk 1 not present");
 
+  acquire(&idelock);
+  idequeueadd(b);
   release(&idelock);
 }
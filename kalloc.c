@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or physically
+// contiguous blocks of 2^order pages with kalloc_order().
 
 #include "types.h"
 #include "defs.h"
@@ -8,9 +9,14 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "x86.h"
 
 #define NUMPAGES (PHYSTOP / PGSIZE)
 #define PAGEINDEX(va) ((V2P(va) / PGSIZE))
+#define MAGSIZE 64         // Max free pages cached by a cpu
+#define MAGBATCH 32        // Pages moved at once to/from kmem.free
+#define ZEROPOOL 256       // Max pre-zeroed pages kept for kalloc_zeroed()
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -18,15 +24,55 @@ extern char end[]; // first address after kernel loaded from ELF file
 
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// Free memory is kept by a buddy allocator: free[k] is a circular
+// list of the free blocks of 2^k pages, each aligned to its size.
+// The block of 2^k pages starting at page i has its buddy at page
+// i ^ (1<<k), and when both are free they are merged into a block
+// of 2^(k+1) pages. pageinfo[i] is PGFREE|k if page i is the first
+// page of a free block of 2^k pages, 0 otherwise.
+//
+// The reference counts of the pages are updated with atomic
+// instructions, so sharing and unsharing pages does not need
+// the lock. They are wide enough for every process to share a page.
+#define PGFREE 0x80
+
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
-  unsigned char cow_reference_count[NUMPAGES];
+  struct run free[MAXORDER+1];
+  uint nfree;                  // Free pages in the lists
+  uchar pageinfo[NUMPAGES];
+  ushort cow_reference_count[NUMPAGES];
 } kmem;
 
+// Per-cpu magazines of free pages. kalloc() and kfree() work on
+// the magazine of their cpu with interrupts off, and only take
+// kmem.lock to refill it from, or drain it to, the global free list
+// MAGBATCH pages at a time. Pages cached by one cpu are not seen
+// by the others, so at most NCPU*MAGSIZE pages can be stranded.
+struct magazine {
+  struct run *list;
+  int n;
+} __attribute__((aligned(64)));
+
+static struct magazine magazines[NCPU];
+
+// Pages already filled with zeros by idle cpus (see kzerofill()),
+// so that kalloc_zeroed() does not have to clear them itself.
+// The pages in the pool are allocated, with a reference count of 1.
+// While stopped is set no cpu starts filling a page, and filling
+// counts the cpus that are still zeroing one.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  int stopped;
+  int filling;
+} kzero;
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -35,8 +81,13 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int k;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
   kmem.use_lock = 0;
+  for(k = 0; k <= MAXORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
   freerange(vstart, vend);
 }
 
@@ -55,6 +106,108 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+static void
+listadd(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void
+listremove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Takes a block of 2^order pages off the free lists, splitting
+// a bigger block if there is none of that size.
+// Called with kmem.lock held.
+static struct run*
+buddyalloc(int order)
+{
+  struct run *r, *b;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(kmem.free[k].next != &kmem.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = kmem.free[k].next;
+  listremove(r);
+  kmem.pageinfo[PAGEINDEX(r)] = 0;
+  // Give back the upper halves of the block.
+  while(k > order){
+    k--;
+    b = (struct run*)((char*)r + (PGSIZE << k));
+    kmem.pageinfo[PAGEINDEX(b)] = PGFREE | k;
+    listadd(&kmem.free[k], b);
+  }
+  kmem.nfree -= 1 << order;
+  return r;
+}
+
+// Puts back a block of 2^order pages, merging it with its
+// buddy for as long as the buddy is free.
+// Called with kmem.lock held.
+static void
+buddyfree(char *v, int order)
+{
+  uint i, b;
+
+  kmem.nfree += 1 << order;
+  i = PAGEINDEX(v);
+  for(; order < MAXORDER; order++){
+    b = i ^ (1 << order);
+    if(b >= NUMPAGES || kmem.pageinfo[b] != (PGFREE | order))
+      break;
+    listremove((struct run*)P2V(b * PGSIZE));
+    kmem.pageinfo[b] = 0;
+    i &= ~(1 << order);
+  }
+  kmem.pageinfo[i] = PGFREE | order;
+  listadd(&kmem.free[order], (struct run*)P2V(i * PGSIZE));
+}
+
+// Move up to MAGBATCH pages from the global free lists
+// to the magazine m. Called with interrupts off.
+static void
+refill(struct magazine *m)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(m->n < MAGBATCH && (r = buddyalloc(0)) != 0){
+    r->next = m->list;
+    m->list = r;
+    m->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Give MAGBATCH pages of the magazine m back to the
+// global free lists. Called with interrupts off.
+static void
+drain(struct magazine *m)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < MAGBATCH; i++){
+    r = m->list;
+    m->list = r->next;
+    buddyfree((char*)r, 0);
+  }
+  m->n -= MAGBATCH;
+  release(&kmem.lock);
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -64,21 +217,75 @@ void
 kfree(char *v)
 {
   struct run *r;
+  struct magazine *m;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.cow_reference_count[(V2P(v) / PGSIZE)] = 0;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  kmem.cow_reference_count[PAGEINDEX(v)] = 0;
+  if(!kmem.use_lock){
+    // Still booting on one cpu.
+    buddyfree(v, 0);
+    return;
+  }
+
+  pushcli();
+  m = &magazines[cpuid()];
+  if(m->n == MAGSIZE)
+    drain(m);
+  r->next = m->list;
+  m->list = r;
+  m->n++;
+  popcli();
+}
+
+// Takes a page off the free pages of this cpu.
+static char*
+allocfree(void)
+{
+  struct run *r;
+  struct magazine *m;
+
+  if(!kmem.use_lock){
+    if((r = buddyalloc(0)) != 0)
+      kmem.cow_reference_count[PAGEINDEX(r)] = 1;
+    return (char*)r;
+  }
+
+  pushcli();
+  m = &magazines[cpuid()];
+  if(m->n == 0)
+    refill(m);
+  if((r = m->list) != 0){
+    m->list = r->next;
+    m->n--;
+    kmem.cow_reference_count[PAGEINDEX(r)] = 1;
+  }
+  popcli();
+  return (char*)r;
+}
+
+// Takes a page from the pre-zeroed pool, 0 if it is empty.
+static char*
+kzeroget(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return (char*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -86,41 +293,121 @@ kfree(char *v)
 // Returns 0 if the memory cannot be allocated.
 char*
 kalloc(void)
+{
+  char *v;
+
+  // Out of free pages, use up the zeroed ones.
+  if((v = allocfree()) == 0)
+    v = kzeroget();
+  return v;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Order 0 is the same as kalloc().
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_order(int order)
 {
   struct run *r;
 
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r) {
-    kmem.freelist = r->next;
-    kmem.cow_reference_count[PAGEINDEX(r)] = 1;
-  }
+  r = buddyalloc(order);
   if(kmem.use_lock)
     release(&kmem.lock);
+  if(r)
+    kmem.cow_reference_count[PAGEINDEX(r)] = 1;
   return (char*)r;
 }
 
-// Increase the reference count for the page.
+// Free the 2^order pages at v, which should have been
+// returned by kalloc_order(order).
 void
-incref(char *v)
+kfree_order(char *v, int order)
 {
+  if(order == 0){
+    kfree(v);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || V2P(v) % (PGSIZE << order) ||
+     v < end || V2P(v) + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+#ifdef KDEBUG
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+#endif
+
+  kmem.cow_reference_count[PAGEINDEX(v)] = 0;
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  kmem.cow_reference_count[PAGEINDEX(v)] += 1;
+  buddyfree(v, order);
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
-// Decrease the reference count for the page.
+// Allocate one 4096-byte page of physical memory
+// filled with zeros.
+char*
+kalloc_zeroed(void)
+{
+  char *v;
+
+  if((v = kzeroget()) != 0)
+    return v;
+  if((v = kalloc()) != 0)
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Called by the scheduler of an idle cpu. Zeroes a free page
+// and adds it to the pool. Returns 0 if there was nothing to do.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock || kzero.n >= ZEROPOOL || kzero.stopped)
+    return 0;
+  acquire(&kzero.lock);
+  if(kzero.n >= ZEROPOOL || kzero.stopped){
+    release(&kzero.lock);
+    return 0;
+  }
+  kzero.filling++;
+  release(&kzero.lock);
+
+  if((r = (struct run*)allocfree()) != 0)
+    memset(r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  if(r){
+    r->next = kzero.list;
+    kzero.list = r;
+    kzero.n++;
+  }
+  kzero.filling--;
+  release(&kzero.lock);
+  return r != 0;
+}
+
+// Increase the reference count for the page.
 void
+incref(char *v)
+{
+  __sync_fetch_and_add(&kmem.cow_reference_count[PAGEINDEX(v)], 1);
+}
+
+// Decrease the reference count for the page and return
+// the references left. The caller that sees 0 must kfree it.
+int
 decref(char *v)
 {
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  kmem.cow_reference_count[PAGEINDEX(v)] -= 1;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  return __sync_sub_and_fetch(&kmem.cow_reference_count[PAGEINDEX(v)], 1);
 }
 
 // Returns the reference count for the page.
@@ -131,3 +418,131 @@ refcount(char *v)
 }
 
 
+
+#ifdef KTEST
+// Prints the amount of free blocks of each order.
+static void
+buddystat(char *when)
+{
+  struct run *r;
+  int k, n;
+
+  cprintf("kalloctest: %s, %d free pages:", when, kmem.nfree);
+  for(k = 0; k <= MAXORDER; k++){
+    n = 0;
+    for(r = kmem.free[k].next; r != &kmem.free[k]; r = r->next)
+      n++;
+    cprintf(" %d", n);
+  }
+  cprintf("\n");
+}
+
+// Counts the pages that are free or in the pre-zeroed pool.
+// Only meaningful while kzero is stopped and the other cpus
+// have nothing to run, so that their magazines do not change.
+static uint
+testcount(void)
+{
+  uint n;
+  int i;
+
+  acquire(&kzero.lock);
+  acquire(&kmem.lock);
+  n = kmem.nfree + kzero.n;
+  for(i = 0; i < ncpu; i++)
+    n += magazines[i].n;
+  release(&kmem.lock);
+  release(&kzero.lock);
+  return n;
+}
+
+static char*
+testalloc(int order)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  r = buddyalloc(order);
+  release(&kmem.lock);
+  if(r == 0)
+    panic("kalloctest: alloc");
+  return (char*)r;
+}
+
+static void
+testfree(char *v, int order)
+{
+  acquire(&kmem.lock);
+  buddyfree(v, order);
+  release(&kmem.lock);
+}
+
+// Boot time benchmark of the buddy allocator, run by main()
+// in kernels built with "make KTEST=1", before the first process
+// exists. The other cpus are already scheduling, so the idle
+// zeroing of pages is stopped while it runs.
+void
+kalloctest(void)
+{
+  struct run *list, *r, *f;
+  uint64 t;
+  uint nfree, n, i;
+  int k;
+
+  acquire(&kzero.lock);
+  kzero.stopped = 1;
+  while(kzero.filling > 0){
+    release(&kzero.lock);
+    acquire(&kzero.lock);
+  }
+  release(&kzero.lock);
+
+  nfree = testcount();
+  buddystat("boot");
+
+  // Throughput of alloc/free pairs of each order,
+  // and of kalloc()/kfree() through the magazines.
+  for(k = 0; k <= MAXORDER; k++){
+    t = rdtsc();
+    for(i = 0; i < 1000; i++)
+      testfree(testalloc(k), k);
+    cprintf("kalloctest: order %d: %d cycles per alloc/free\n",
+            k, (uint)(rdtsc() - t) / 1000);
+  }
+  t = rdtsc();
+  for(i = 0; i < 1000; i++)
+    kfree(kalloc());
+  cprintf("kalloctest: kalloc: %d cycles per alloc/free\n",
+          (uint)(rdtsc() - t) / 1000);
+
+  // Fragment memory by taking single pages and giving
+  // back every other one, then check that the blocks are
+  // merged again once everything is freed.
+  list = 0;
+  t = rdtsc();
+  for(n = 0; n < 8192; n++){
+    r = (struct run*)testalloc(0);
+    r->next = list;
+    list = r;
+  }
+  cprintf("kalloctest: %d single pages in %d cycles each\n",
+          n, (uint)(rdtsc() - t) / n);
+  for(r = list; r && r->next; r = r->next){
+    f = r->next;
+    r->next = f->next;
+    testfree((char*)f, 0);
+  }
+  buddystat("every other page freed");
+  while((r = list) != 0){
+    list = r->next;
+    testfree((char*)r, 0);
+  }
+  buddystat("all freed");
+  if(testcount() != nfree)
+    panic("kalloctest: lost pages");
+
+  acquire(&kzero.lock);
+  kzero.stopped = 0;
+  release(&kzero.lock);
+}
+#endif
@@ -31,6 +31,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
+  #define ONESHOT    0x00000000   // One-shot
   #define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -42,6 +43,14 @@
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
 volatile uint *lapic;  // Initialized in mp.c
+uint lapictick;        // Timer counts per clock tick
+uint64 tsctick;        // Time-stamp counter cycles per clock tick
+
+// 8253/8254 programmable interval timer, channel 2.
+#define PIT_HZ     1193182   // Input clock frequency
+#define PIT_CH2    0x42      // Channel 2 counter
+#define PIT_MODE   0x43      // Mode/command register
+#define PIT_GATE   0x61      // Channel 2 gate and output
 
 //PAGEBREAK!
 static void
@@ -51,6 +60,33 @@ lapicw(int index, int value)
   lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure how many timer counts and TSC cycles make one
+// clock tick, using channel 2 of the PIT as time source.
+static void
+calibrate(void)
+{
+  uint latch = PIT_HZ / HZ;
+  uint64 tsc0;
+
+  // Gate channel 2 on and speaker off, then start a one-shot
+  // count (mode 0) of one tick. Bit 5 of PIT_GATE rises at the end.
+  outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+  outb(PIT_MODE, 0xB0);
+  outb(PIT_CH2, latch & 0xFF);
+  outb(PIT_CH2, latch >> 8);
+
+  lapicw(TIMER, MASKED);
+  lapicw(TICR, 0xFFFFFFFF);
+  tsc0 = rdtsc();
+  while((inb(PIT_GATE) & 0x20) == 0)
+    ;
+  tsctick = rdtsc() - tsc0;
+  lapictick = 0xFFFFFFFF - lapic[TCCR];
+
+  if(lapictick == 0)
+    lapictick = 10000000;
+}
+
 void
 lapicinit(void)
 {
@@ -60,13 +96,16 @@ lapicinit(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down once at bus frequency from
+  // lapic[TICR] and then issues an interrupt. Each interrupt
+  // programs the next one (see timerarm in trap.c), so cpus
+  // with nothing to do can skip ticks. The boot cpu calibrates
+  // TICR against the PIT, the others reuse its result.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  if(lapictick == 0)
+    calibrate();
+  lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, lapictick);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +152,29 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Program the timer to interrupt once after n clock ticks.
+void
+lapictimer(uint n)
+{
+  if(!lapic)
+    return;
+  if(n > 0xFFFFFFFF / lapictick)
+    n = 0xFFFFFFFF / lapictick;
+  lapicw(TICR, n * lapictick);
+}
+
+// Send interrupt vector to the cpu with the given apicid.
+void
+lapicipi(int apicid, int vector)
+{
+  if(!lapic)
+    return;
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
@@ -69,15 +69,22 @@ initlog(int dev)
 static void
 install_trans(void)
 {
+  struct buf *dbufs[LOGSIZE];
   int tail;
 
+  // Queue all the writes before waiting for any, so that
+  // the disk can sort them and merge consecutive blocks.
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
+    bwritestart(dbuf);  // write dst to disk
     brelse(lbuf);
-    brelse(dbuf);
+    dbufs[tail] = dbuf;
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(dbufs[tail]);
+    brelse(dbufs[tail]);
   }
 }
 
@@ -177,15 +184,22 @@ end_op(void)
 static void
 write_log(void)
 {
+  struct buf *tos[LOGSIZE];
   int tail;
 
+  // The log blocks are consecutive: queued together,
+  // they go to the disk in a few large writes.
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bwritestart(to);  // write the log
     brelse(from);
-    brelse(to);
+    tos[tail] = to;
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(tos[tail]);
+    brelse(tos[tail]);
   }
 }
 
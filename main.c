@@ -28,11 +28,17 @@ main(void)
   uartinit();      // serial port
   pinit();         // process table
   tvinit();        // trap vectors
-  binit();         // buffer cache
+  slabinit();      // kernel object caches
   fileinit();      // file table
+  pipeinit();      // pipe cache
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  binit();         // buffer cache
+#ifdef KTEST
+  kalloctest();    // allocator benchmarks
+  bcachetest();    // buffer cache benchmarks
+#endif
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
@@ -53,6 +59,7 @@ mpmain(void)
 {
   cprintf("cpu%d: starting %d\n", cpuid(), cpuid());
   idtinit();       // load idt register
+  lcr4(rcr4() | CR4_PGE); // keep kernel mappings across CR3 loads
   xchg(&(mycpu()->started), 1); // tell startothers() we're up
   scheduler();     // start running processes
 }
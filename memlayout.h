@@ -7,6 +7,8 @@
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
+#define MMAPBASE 0x70000000         // File mappings, up to SHMBASE
+#define SHMBASE  0x7F000000         // Shared memory segments, up to KERNBASE
 
 #define V2P(a) (((uint) (a)) - KERNBASE)
 #define P2V(a) ((void *)(((char *) (a)) + KERNBASE))
@@ -0,0 +1,293 @@
+// File mappings.
+//
+// mmap() maps part of a file in its slot of the process, above
+// MMAPBASE. Nothing is read until the process touches a page:
+// the fault (see mmapin() in vm.c) maps a page of the file read
+// through the buffer cache. The pages read are kept in a small
+// cache, and every mapping of the same page of a file shares the
+// same physical page, read-only. Writing to a writable mapping
+// gives the process a private copy, like copy-on-write after
+// fork(); changes are never written back to the file.
+//
+// The pages of a file are a snapshot of its contents when they
+// were read. Writing to the file drops them from the cache, so
+// new faults see the new contents, but pages already mapped keep
+// the old ones.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define MMAPSLOT  ((SHMBASE - MMAPBASE) / PROCMAXMMAP)  // Room for a mapping
+
+struct filepage {
+  uint dev;                // Device and inode of the file,
+  uint inum;
+  uint off;                // offset of the page in the file,
+  char *page;              // and its contents; 0 if unused.
+};
+
+// The cache holds a reference to each of its pages, and every
+// mapping of a page another one.
+struct {
+  struct spinlock lock;
+  struct filepage pages[NFILEPAGE];
+  int hand;                // Next entry to look at for reuse
+} fcache;
+
+void
+mmapinit(void)
+{
+  initlock(&fcache.lock, "fcache");
+}
+
+// Looks for the page at off of ip in the cache and
+// takes a reference to it. Called with fcache.lock held.
+static char*
+fcachelookup(struct inode *ip, uint off)
+{
+  struct filepage *fp;
+
+  for(fp = fcache.pages; fp < &fcache.pages[NFILEPAGE]; fp++){
+    if(fp->page && fp->dev == ip->dev && fp->inum == ip->inum &&
+       fp->off == off){
+      incref(fp->page);
+      return fp->page;
+    }
+  }
+  return 0;
+}
+
+// Drops the cache's reference to the page of fp.
+// Called with fcache.lock held.
+static void
+fcachedrop(struct filepage *fp)
+{
+  if(decref(fp->page) == 0)
+    kfree(fp->page);
+  fp->page = 0;
+}
+
+// Puts page in the cache, in an unused entry or in one whose page
+// is not mapped anywhere. If there is none the page is not cached.
+// Called with fcache.lock held.
+static void
+fcacheinsert(struct inode *ip, uint off, char *page)
+{
+  struct filepage *fp;
+  int i;
+
+  for(i = 0; i < NFILEPAGE; i++){
+    fp = &fcache.pages[fcache.hand];
+    fcache.hand = (fcache.hand + 1) % NFILEPAGE;
+    if(fp->page == 0 || refcount(fp->page) == 1){
+      if(fp->page)
+        fcachedrop(fp);
+      fp->dev = ip->dev;
+      fp->inum = ip->inum;
+      fp->off = off;
+      fp->page = page;
+      incref(page);
+      return;
+    }
+  }
+}
+
+// Returns the page at off of ip, with a reference taken for the
+// caller, or 0 if out of memory. Bytes past the end of the file
+// read as zeros. May sleep.
+char*
+filepage(struct inode *ip, uint off)
+{
+  char *mem, *v;
+  uint n;
+
+  acquire(&fcache.lock);
+  v = fcachelookup(ip, off);
+  release(&fcache.lock);
+  if(v)
+    return v;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return 0;
+  ilock(ip);
+  if(off < ip->size){
+    n = ip->size - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    if(readi(ip, mem, off, n) != n){
+      iunlock(ip);
+      kfree(mem);
+      return 0;
+    }
+  }
+  iunlock(ip);
+
+  // Somebody else may have read it meanwhile.
+  acquire(&fcache.lock);
+  if((v = fcachelookup(ip, off)) != 0){
+    release(&fcache.lock);
+    kfree(mem);
+    return v;
+  }
+  fcacheinsert(ip, off, mem);
+  release(&fcache.lock);
+  return mem;
+}
+
+// Drops the cached pages of ip, once its contents change.
+void
+mmapinval(struct inode *ip)
+{
+  struct filepage *fp;
+
+  acquire(&fcache.lock);
+  for(fp = fcache.pages; fp < &fcache.pages[NFILEPAGE]; fp++)
+    if(fp->page && fp->dev == ip->dev && fp->inum == ip->inum)
+      fcachedrop(fp);
+  release(&fcache.lock);
+}
+
+// Returns the mapping of p that va lies in, or 0.
+struct vmmap*
+mmapfind(struct proc *p, uint va)
+{
+  struct vmmap *m;
+
+  for(m = p->mmaps; m < &p->mmaps[PROCMAXMMAP]; m++)
+    if(m->ip && va >= m->va && va - m->va < m->len)
+      return m;
+  return 0;
+}
+
+// Returns 1 if va to va+n lies in a mapping of p.
+int
+mmaprange(struct proc *p, uint va, uint n)
+{
+  struct vmmap *m;
+
+  m = mmapfind(p, va);
+  return m && va + n >= va && va + n <= m->va + m->len;
+}
+
+// Returns 0 if va lies in a mapping of p that p may not write to.
+int
+mmapwritable(struct proc *p, uint va)
+{
+  struct vmmap *m;
+
+  m = mmapfind(p, va);
+  return m == 0 || (m->prot & PROT_WRITE);
+}
+
+// Maps len bytes of f, from offset off on, in the current process.
+// prot says whether the process may read or also write the pages.
+// Returns the address of the mapping or -1.
+int
+mmap(struct file *f, uint off, int len, int prot)
+{
+  struct proc *p = myproc();
+  struct vmmap *m;
+  int i;
+
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(off % PGSIZE != 0 || len <= 0 || len > MMAPSLOT)
+    return -1;
+  if(!(prot & PROT_READ) || (prot & ~(PROT_READ|PROT_WRITE)))
+    return -1;
+
+  ilock(f->ip);
+  if(f->ip->type != T_FILE){
+    iunlock(f->ip);
+    return -1;
+  }
+  iunlock(f->ip);
+
+  for(i = 0; i < PROCMAXMMAP; i++){
+    m = &p->mmaps[i];
+    if(m->ip == 0){
+      m->ip = idup(f->ip);
+      m->va = MMAPBASE + i*MMAPSLOT;
+      m->off = off;
+      m->len = len;
+      m->prot = prot;
+      return m->va;
+    }
+  }
+  return -1;
+}
+
+// Lets the file of m go. The pages stay mapped.
+static void
+unmap(struct vmmap *m)
+{
+  struct inode *ip;
+
+  ip = m->ip;
+  m->ip = 0;
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+// Unmaps the mapping starting at va of the current process.
+// Returns 0 in case of success, -1 if there isn't one.
+int
+munmap(uint va)
+{
+  struct proc *p = myproc();
+  struct vmmap *m;
+
+  if((m = mmapfind(p, va)) == 0 || m->va != va)
+    return -1;
+  deallocuvm(p->pgdir, m->va + PGROUNDUP(m->len), m->va);
+  flushtlb();
+  unmap(m);
+  return 0;
+}
+
+// Gives the child the mappings of the parent. The pages the parent
+// already touched are shared read-only, so that the private copies
+// of writable mappings are copied on write again.
+// Returns -1 if out of memory, with the child holding no mappings.
+int
+mmapcopy(struct proc *parent, struct proc *child)
+{
+  struct vmmap *m, *cm;
+
+  for(m = parent->mmaps; m < &parent->mmaps[PROCMAXMMAP]; m++){
+    cm = &child->mmaps[m - parent->mmaps];
+    if(m->ip == 0)
+      continue;
+    *cm = *m;
+    cm->ip = idup(m->ip);
+    if(shareuvm(parent->pgdir, child->pgdir, m->va, m->len) < 0){
+      // The pages shared so far go away with the child's pgdir.
+      mmapexit(child);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Drops every mapping of p, on exit() or exec(). The pages
+// go away with the page table p used until now.
+void
+mmapexit(struct proc *p)
+{
+  struct vmmap *m;
+
+  for(m = p->mmaps; m < &p->mmaps[PROCMAXMMAP]; m++)
+    if(m->ip)
+      unmap(m);
+}
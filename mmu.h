@@ -10,6 +10,7 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -83,6 +84,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define BIGPGSIZE       (PGSIZE*NPTENTRIES) // bytes mapped by a PTE_PS page
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -95,6 +97,12 @@ struct segdesc {
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global, kept in the TLB across CR3 loads
+
+// Page fault error code bits
+#define FEC_PR          0x001   // Page was present (protection violation)
+#define FEC_WR          0x002   // Caused by a write
+#define FEC_U           0x004   // Caused in user mode
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -0,0 +1,52 @@
+// PCI configuration space, through configuration
+// mechanism #1 (I/O ports 0xCF8 and 0xCFC).
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+#define CONFADDR  0xCF8
+#define CONFDATA  0xCFC
+
+// Reads configuration register off of the function with the given tag.
+uint
+pciread(int tag, int off)
+{
+  outl(CONFADDR, 0x80000000 | tag | (off & 0xFC));
+  return inl(CONFDATA);
+}
+
+void
+pciwrite(int tag, int off, uint v)
+{
+  outl(CONFADDR, 0x80000000 | tag | (off & 0xFC));
+  outl(CONFDATA, v);
+}
+
+// Looks for a function of the given class and subclass on bus 0.
+// Returns its tag, or -1 if there is none.
+int
+pcifind(int class, int subclass)
+{
+  int dev, func, tag;
+  uint c;
+
+  for(dev = 0; dev < 32; dev++){
+    for(func = 0; func < 8; func++){
+      tag = PCITAG(0, dev, func);
+      if((pciread(tag, PCI_ID) & 0xFFFF) == 0xFFFF){
+        if(func == 0)
+          break;
+        continue;
+      }
+      c = pciread(tag, PCI_CLASS);
+      if((c >> 24) == class && ((c >> 16) & 0xFF) == subclass)
+        return tag;
+      // Only multi-function devices have functions past 0.
+      if(func == 0 && !(pciread(tag, PCI_HEADER) & 0x800000))
+        break;
+    }
+  }
+  return -1;
+}
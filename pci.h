@@ -0,0 +1,15 @@
+// PCI configuration space registers.
+#define PCI_ID        0x00  // Device id, vendor id
+#define PCI_COMMAND   0x04  // Status, command
+#define PCI_CLASS     0x08  // Class, subclass, interface, revision
+#define PCI_HEADER    0x0C  // Header type in bits 16-23
+#define PCI_BAR(n)    (0x10 + 4*(n))  // Base address registers
+
+#define PCI_CMD_IO      0x1   // Decode I/O space accesses
+#define PCI_CMD_MASTER  0x4   // Allow bus mastering (DMA)
+
+#define PCI_CLASS_STORAGE  0x01
+#define PCI_SUBCLASS_IDE   0x01
+
+// Tag of a function, as used in configuration addresses.
+#define PCITAG(bus, dev, func)  (((bus) << 16) | ((dev) << 11) | ((func) << 8))
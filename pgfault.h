@@ -0,0 +1,12 @@
+// Page fault classes, see handlepgflt() in vm.c.
+#define PF_COWCOPY   0   // Write to a shared copy-on-write page, copied
+#define PF_COWREUSE  1   // Write to a copy-on-write page nobody else shares
+#define PF_ZERO      2   // First touch of a bss, heap or stack page
+#define PF_FILE      3   // First touch of a page read from the executable
+#define PF_INVALID   4   // Bad access, or the page could not be mapped
+#define NPFCLASS     5
+
+struct faultstat {
+  uint count[NPFCLASS];    // Faults of each class
+  uint64 cycles[NPFCLASS]; // TSC cycles spent handling them
+};
@@ -4,12 +4,26 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
 
+// Queue of the processes sleeping on the channels that
+// hash to the same bucket, in the order they went to sleep.
+struct waitqueue {
+  struct proc *head;
+  struct proc *last;
+};
+
+#define NWAITQ 64
+#define NPIDHASH 256
+
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct waitqueue waitq[NWAITQ];  // Sleeping processes hashed by chan
+  struct proc *pidhash[NPIDHASH];  // Processes hashed by pid
+  struct proc *freelist;           // UNUSED processes
 } ptable;
 
 // Linked list that represents a level of priority and 
@@ -20,8 +34,27 @@ struct level {
   struct proc *last;
 };
 
-// Priority levels of processes
-struct level levels[PLEVELS];
+// Per-CPU run queue. Each CPU owns a full set of priority
+// levels guarded by its own lock, so the common scheduling
+// path (yield, enqueue, dequeue) only touches the local queue.
+// The lock is also held across swtch() between a process and
+// the scheduler of the CPU, so it protects the state of the
+// processes it holds. Lock order: ptable.lock before rq->lock.
+// Aligned so that two run queues never share a cache line.
+// Bit i of bitmap is set iff levels[i] is non-empty, so the
+// next level to run is found with a single bit scan.
+struct runqueue {
+  struct spinlock lock;
+  struct level levels[PLEVELS];
+  uint bitmap;                  // Non-empty levels
+  int nrunnable;                // Amount of processes on the levels
+} __attribute__((aligned(64)));
+
+#if PLEVELS > 32
+#error "PLEVELS must fit in the run queue bitmap"
+#endif
+
+struct runqueue runqueues[NCPU];
 
 static struct proc *initproc;
 
@@ -30,13 +63,17 @@ extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static void waitqadd(struct proc *p);
+static void kick(struct runqueue *rq);
 
-// Must be called with ptable locked to avoid data corruption
+// Must be called with p->rq locked to avoid data corruption
 // between different processes. Enqueues a process at its
-// corresponding priority level.
+// corresponding priority level of its run queue.
 void
 enqueue(struct proc *p)
 {
+  struct level *l;
+
   if(!p)
     panic("enqueue called with null process\n");
 
@@ -44,48 +81,59 @@ enqueue(struct proc *p)
   p->state = RUNNABLE;
 
   // Enqueue process at the head of the linked list.
-  p->next = levels[p->nice].head;
+  l = &p->rq->levels[p->nice];
+  p->next = l->head;
   p->back = 0;
-  if(levels[p->nice].head)
-    levels[p->nice].head->back = p;
+  if(l->head)
+    l->head->back = p;
   else
-    levels[p->nice].last = p;
-  levels[p->nice].head = p;
+    l->last = p;
+  l->head = p;
+  p->rq->bitmap |= 1U << p->nice;
+  p->rq->nrunnable++;
+
+  // Pairs with the barrier in idle(): either the cpu sees
+  // the process before halting or we see it halted.
+  __sync_synchronize();
+  kick(p->rq);
 }
 
-// Must be called with ptable locked to avoid data corruption
+// Must be called with rq locked to avoid data corruption
 // between different processes. Dequeues a process from a given
-// priority level.
+// priority level of the run queue.
 struct proc*
-dequeue(int level)
+dequeue(struct runqueue *rq, int level)
 {
+  struct level *l = &rq->levels[level];
   // Get the process to dequeue.
-  struct proc *p = levels[level].last;
+  struct proc *p = l->last;
 
   if(!p)
     panic("dequeue of empty priority level\n");
 
   // Dequeue the process from the end of the linked list.
   if(!p->back){
-    levels[level].last = 0;
-    levels[level].head = 0;
+    l->last = 0;
+    l->head = 0;
+    rq->bitmap &= ~(1U << level);
   }
   else {
     p->back->next = 0;
-    levels[level].last = p->back;
+    l->last = p->back;
   }
   p->back = 0;
   p->next = 0;
+  rq->nrunnable--;
   return p;
 }
 
 // Returns true if the level is empty, false otherwise.
 int
-isempty(int level) 
+isempty(struct runqueue *rq, int level)
 {
   if(level < 0 || level >= PLEVELS)
     panic("is empty call over invalid level value\n");
-  return !levels[level].head;
+  return !(rq->bitmap & (1U << level));
 }
 
 // Lowers process's priority if possible.
@@ -108,26 +156,29 @@ increasepriority(struct proc *p)
     p->nice--;
 }
 
-// Must be called with ptable locked to avoid data corruption
+// Must be called with p->rq locked to avoid data corruption
 // between different processes. Removes a process from an specified
-// priority level.
+// priority level of its run queue.
 void
 removefromlevel(struct proc *p, int level)
 {
+  struct level *l = &p->rq->levels[level];
+
   // If is the only process on the level.
   if(!p->back && !p->next){
-    levels[level].head = 0;
-    levels[level].last = 0;
+    l->head = 0;
+    l->last = 0;
+    p->rq->bitmap &= ~(1U << level);
   }
   else {
     // If is the last process on the level.
     if(!p->next){
       p->back->next = 0;
-      levels[level].last = p->back;
+      l->last = p->back;
     }
     // If is the first process of the level.
     else if(!p->back){
-      levels[level].head = p->next;
+      l->head = p->next;
       p->next->back = 0;
     }
     else {
@@ -138,15 +189,216 @@ removefromlevel(struct proc *p, int level)
   }
   p->back = 0;
   p->next = 0;
+  p->rq->nrunnable--;
+}
+
+// Returns the run queue with the fewest RUNNABLE processes,
+// preferring the one of the calling CPU on ties. Reads the
+// counters without locking, the result is only a hint.
+static struct runqueue*
+leastloaded(void)
+{
+  struct runqueue *rq, *best;
+
+  pushcli();
+  best = mycpu()->rq;
+  popcli();
+  for(rq = runqueues; rq < &runqueues[ncpu]; rq++)
+    if(rq->nrunnable < best->nrunnable)
+      best = rq;
+  return best;
+}
+
+// Returns the run queue with the most RUNNABLE processes other
+// than rq, or 0 if all of them are empty. Reads the counters
+// without locking, the result is only a hint.
+static struct runqueue*
+busiest(struct runqueue *rq)
+{
+  struct runqueue *r, *best = 0;
+
+  for(r = runqueues; r < &runqueues[ncpu]; r++)
+    if(r != rq && r->nrunnable > 0 && (!best || r->nrunnable > best->nrunnable))
+      best = r;
+  return best;
+}
+
+// Acquires the locks of two different run queues.
+// They are always taken in address order to avoid deadlocks.
+static void
+acquirepair(struct runqueue *a, struct runqueue *b)
+{
+  if(a < b){
+    acquire(&a->lock);
+    acquire(&b->lock);
+  } else {
+    acquire(&b->lock);
+    acquire(&a->lock);
+  }
+}
+
+static void
+releasepair(struct runqueue *a, struct runqueue *b)
+{
+  release(&a->lock);
+  release(&b->lock);
+}
+
+// Must be called with both run queues locked. Moves a process
+// from the lowest priority non-empty level of from to the same
+// level of to. The most recently enqueued process of the level
+// is taken, which is the one from would run last.
+// Returns 1 if a process was moved, 0 if from is empty.
+static int
+migrate(struct runqueue *from, struct runqueue *to)
+{
+  struct proc *p;
+  int i;
+
+  if(!from->bitmap)
+    return 0;
+
+  i = bsr(from->bitmap);
+  p = from->levels[i].head;
+  removefromlevel(p, i);
+  p->rq = to;
+  enqueue(p);
+  return 1;
+}
+
+// Called by an idle cpu with an empty run queue rq.
+// Steals a RUNNABLE process from the busiest cpu.
+// Returns 1 if a process was stolen, 0 otherwise.
+static int
+steal(struct runqueue *rq)
+{
+  struct runqueue *victim;
+  int r;
+
+  if((victim = busiest(rq)) == 0)
+    return 0;
+  acquirepair(rq, victim);
+  r = migrate(victim, rq);
+  releasepair(rq, victim);
+  return r;
+}
+
+// Must be called with rq locked after enqueueing a process.
+// Wakes up the cpu of rq if it is halted. If it is busy and
+// there are more processes waiting, wakes up some other
+// halted cpu so it can steal one of them.
+static void
+kick(struct runqueue *rq)
+{
+  struct cpu *c = &cpus[rq - runqueues];
+
+  if(c != mycpu() && c->halted){
+    lapicipi(c->apicid, T_IRQ0 + IRQ_WAKEUP);
+    return;
+  }
+  if(rq->nrunnable < 2)
+    return;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c != mycpu() && c->halted){
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKEUP);
+      return;
+    }
+  }
+}
+
+// Halts the cpu c until the next interrupt, unless there is
+// something in its run queue. Processes enqueued while the cpu
+// is halted get it running again through kick().
+static void
+idle(struct cpu *c)
+{
+  uint64 tsc0;
+
+  cli();
+  c->halted = 1;
+  __sync_synchronize();
+  if(c->rq->nrunnable == 0){
+    // Skip the ticks nobody needs while halted.
+    timerarm();
+    tsc0 = rdtsc();
+    stihlt();
+    cli();
+    // Idle time accounting.
+    c->idletsc += rdtsc() - tsc0;
+    while(tsctick && c->idletsc >= tsctick){
+      c->idletsc -= tsctick;
+      c->idleticks++;
+    }
+  }
+  c->halted = 0;
+}
+
+// Returns the amount of processes waiting
+// in the run queue of this cpu.
+// Must be called with interrupts disabled.
+int
+cpuload(void)
+{
+  return mycpu()->rq->nrunnable;
+}
+
+// Returns the amount of clock ticks the given cpu
+// spent halted, or -1 if there is no such cpu.
+int
+idleticks(int cpu)
+{
+  if(cpu < 0 || cpu >= ncpu)
+    return -1;
+  return cpus[cpu].idleticks;
+}
+
+// Moves RUNNABLE processes from the busiest run queues to the
+// idlest ones until their loads differ in at most one process.
+// Called periodically from the timer interrupt.
+void
+rebalance(void)
+{
+  struct runqueue *from, *to, *rq;
+  int moves;
+
+  for(moves = 0; moves < NPROC; moves++){
+    from = to = runqueues;
+    for(rq = runqueues; rq < &runqueues[ncpu]; rq++){
+      if(rq->nrunnable > from->nrunnable)
+        from = rq;
+      if(rq->nrunnable < to->nrunnable)
+        to = rq;
+    }
+    if(from == to)
+      return;
+
+    acquirepair(from, to);
+    if(from->nrunnable - to->nrunnable < 2 || !migrate(from, to)){
+      releasepair(from, to);
+      return;
+    }
+    releasepair(from, to);
+  }
 }
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = NPROC - 1; i >= 0; i--){
+    ptable.proc[i].hnext = ptable.freelist;
+    ptable.freelist = &ptable.proc[i];
+  }
+  for(i = 0; i < NCPU; i++){
+    initlock(&runqueues[i].lock, "runqueue");
+    cpus[i].rq = &runqueues[i];
+  }
   seminit();
+  shminit();
+  mmapinit();
 }
-
 // Must be called with interrupts disabled.
 int
 cpuid()
@@ -188,8 +440,34 @@ myproc(void)
   return p;
 }
 
+// Returns the pid hash chain of pid.
+static struct proc**
+pidchain(int pid)
+{
+  return &ptable.pidhash[(uint)pid % NPIDHASH];
+}
+
+// Gives a process slot back to the free list.
+// Must be called with ptable locked.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = pidchain(p->pid); *pp; pp = &(*pp)->hnext){
+    if(*pp == p){
+      *pp = p->hnext;
+      break;
+    }
+  }
+  p->pid = 0;
+  p->state = UNUSED;
+  p->hnext = ptable.freelist;
+  ptable.freelist = p;
+}
+
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the free list.
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
@@ -201,16 +479,18 @@ allocproc(void)
 
   acquire(&ptable.lock);
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
+  if((p = ptable.freelist) == 0){
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.freelist = p->hnext;
 
-found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->hnext = *pidchain(p->pid);
+  *pidchain(p->pid) = p;
+  p->children = 0;
+  p->sibling = 0;
   // Set priority level.
   p->nice = DEFAULTPLEVEL;
 
@@ -218,7 +498,9 @@ found:
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -241,6 +523,11 @@ found:
   p->semcount = 0;
   for(int i = 0; i < PROCMAXSEM; i++) 
     p->semids[i] = -1;
+  for(int i = 0; i < PROCMAXSHM; i++)
+    p->shmids[i] = -1;
+  memset(p->mmaps, 0, sizeof(p->mmaps));
+
+  memset(&p->faults, 0, sizeof(p->faults));
   
   return p;
 }
@@ -276,12 +563,13 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  p->rq = leastloaded();
+  acquire(&p->rq->lock);
 
   // Add process to the priority table.
   enqueue(p);
 
-  release(&ptable.lock);
+  release(&p->rq->lock);
 }
 
 // Grow current process's memory by n bytes.
@@ -294,14 +582,18 @@ growproc(int n)
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Only reserve the memory, the pages are allocated
+    // the first time they are touched (see handlepgflt()).
+    if(sz + n < sz || sz + n >= MMAPBASE)
       return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
+    // Forget the pages just unmapped.
+    flushtlb();
   }
   curproc->sz = sz;
-  switchuvm(curproc);
   return 0;
 }
 
@@ -324,11 +616,24 @@ fork(void)
   if((np->pgdir = cowuvm(curproc->pgdir, curproc->sz)) == 0){
     kfree(np->kstack);
     np->kstack = 0;
-    np->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
     return -1;
   }
   np->sz = curproc->sz;
-  np->parent = curproc;
+  // Inherit shared memory segments and file mappings,
+  // mapped at the same addresses.
+  if(shmcopy(curproc, np) < 0 || mmapcopy(curproc, np) < 0){
+    shmexit(np);
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
@@ -338,6 +643,11 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  np->exe = 0;
+  if(curproc->exe)
+    np->exe = iexecdup(curproc->exe);
+  memmove(np->seg, curproc->seg, sizeof(curproc->seg));
+  np->nseg = curproc->nseg;
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -346,10 +656,18 @@ fork(void)
   // Copy semaphores's descriptor from parent to child.
   semcopy(curproc, np);
 
+  // Link the child to its parent.
   acquire(&ptable.lock);
+  np->parent = curproc;
+  np->sibling = curproc->children;
+  curproc->children = np;
+  release(&ptable.lock);
+
+  np->rq = leastloaded();
+  acquire(&np->rq->lock);
   // Add process to the priority table.
   enqueue(np);
-  release(&ptable.lock);
+  release(&np->rq->lock);
 
   return pid;
 }
@@ -362,7 +680,7 @@ exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p;
-  int fd;
+  int fd, zombies;
 
   if(curproc == initproc)
     panic("init exiting");
@@ -375,10 +693,17 @@ exit(void)
     }
   }
 
+  shmexit(curproc);
+  mmapexit(curproc);
+
   begin_op();
   iput(curproc->cwd);
+  if(curproc->exe)
+    iexecput(curproc->exe);
   end_op();
   curproc->cwd = 0;
+  curproc->exe = 0;
+  curproc->nseg = 0;
 
   acquire(&ptable.lock);
 
@@ -386,16 +711,29 @@ exit(void)
   wakeup1(curproc->parent);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
+  if((p = curproc->children) != 0){
+    zombies = 0;
+    for(;;){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        zombies = 1;
+      if(p->sibling == 0)
+        break;
+      p = p->sibling;
     }
+    p->sibling = initproc->children;
+    initproc->children = curproc->children;
+    curproc->children = 0;
+    if(zombies)
+      wakeup1(initproc);
   }
 
   // Jump into the scheduler, never to return.
+  // The run queue lock is taken before becoming a ZOMBIE
+  // so wait() can tell when we are off our kernel stack.
+  acquire(&curproc->rq->lock);
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -405,29 +743,32 @@ exit(void)
 int
 wait(void)
 {
-  struct proc *p;
+  struct proc *p, **pp;
   int havekids, pid;
   struct proc *curproc = myproc();
   
   acquire(&ptable.lock);
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the children looking for exited ones.
     havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
-        continue;
+    for(pp = &curproc->children; (p = *pp) != 0; pp = &p->sibling){
       havekids = 1;
       if(p->state == ZOMBIE){
-        // Found one.
+        // Found one. Wait for it to finish switching
+        // away from its kernel stack and its page table
+        // (see exit and scheduler).
+        acquire(&p->rq->lock);
+        release(&p->rq->lock);
+        *pp = p->sibling;
         pid = p->pid;
         kfree(p->kstack);
         p->kstack = 0;
         freevm(p->pgdir);
-        p->pid = 0;
         p->parent = 0;
+        p->sibling = 0;
         p->name[0] = 0;
         p->killed = 0;
-        p->state = UNUSED;
+        freeproc(p);
         release(&ptable.lock);
         return pid;
       }
@@ -457,6 +798,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runqueue *rq = c->rq;
   c->proc = 0;
   int i = 0;
   
@@ -464,70 +806,87 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    i = 0;
-
-    // Loop until find a non-empty priority level of processes.
-    acquire(&ptable.lock);
-    while(i < PLEVELS && isempty(i))
-      i++;
-
-    // If its found.
-    if(i < PLEVELS){
+    // Run processes while there are any, from the highest priority
+    // non-empty level. The page table of the last process stays
+    // loaded meanwhile, so running it again needs no CR3 reload.
+    // That is safe while rq->lock is held: the process can't be
+    // freed until it is released (see wait()).
+    acquire(&rq->lock);
+    while(rq->bitmap){
+      i = bsf(rq->bitmap);
       // Dequeue the next process from the level.
-      p = dequeue(i);
+      p = dequeue(rq, i);
 
       // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
+      // to release rq->lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
       switchuvm(p);
       p->state = RUNNING;
 
+      // Back from a long idle timer, bound it by the quantum.
+      if(c->timerticks > QUANTUM)
+        timerarm();
+
       swtch(&(c->scheduler), p->context);
-      switchkvm();
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
       c->proc = 0;
     }
-    release(&ptable.lock);
+    switchkvm();
+    release(&rq->lock);
+
+    // Nothing to run here, take work from a busier cpu,
+    // or zero some free pages ahead of time, or halt until
+    // an interrupt brings some.
+    if(!steal(rq) && !kzerofill())
+      idle(c);
   }
 }
 
 // Performs an aging of all RUNNABLE processes and
 // raises the priority level of those which exeed
-// the age limit.
+// the age limit by AGEBOOST levels, so that a process
+// waits at most 3*AGELIMIT*AGINGSTEP ticks to get
+// from the lowest level to the top, whatever PLEVELS is.
+// Run queues are aged one at a time.
 void
 aging(void)
 {
+  struct runqueue *rq;
   struct proc *p;
   struct proc *next;
-  int i = 1;
-
-  acquire(&ptable.lock);
-  // Loop over levels, from 1 to last.
-  while(i < PLEVELS){
-    p = levels[i].head;
-    // Loop over all processes of a level.
-    while (p != 0){
-      next = p->next;
-      // If exeeds the age limit.
-      if(++p->age >= AGELIMIT){
-        removefromlevel(p,i);
-        increasepriority(p);
-        enqueue(p);
+  uint bits;
+  int i, k;
+
+  for(rq = runqueues; rq < &runqueues[ncpu]; rq++){
+    acquire(&rq->lock);
+    // Loop over non-empty levels, from 1 to last.
+    for(bits = rq->bitmap & ~1; bits; bits &= bits - 1){
+      i = bsf(bits);
+      p = rq->levels[i].head;
+      // Loop over all processes of a level.
+      while (p != 0){
+        next = p->next;
+        // If exeeds the age limit.
+        if(++p->age >= AGELIMIT){
+          removefromlevel(p,i);
+          for(k = 0; k < AGEBOOST; k++)
+            increasepriority(p);
+          p->age = 0;
+          enqueue(p);
+        }
+        // Get next.
+        p = next;
       }
-      // Get next.
-      p = next;
     }
-    i++;
+    release(&rq->lock);
   }
-
-  release(&ptable.lock);
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must hold only the run queue lock of
+// this cpu and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
@@ -539,8 +898,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&p->rq->lock))
+    panic("sched rq.lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -556,17 +915,19 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
+  struct proc *p = myproc();
+
+  acquire(&p->rq->lock);  //DOC: yieldlock
 
   // Reset process tick count.
-  myproc()->ticks_count = 0;
+  p->ticks_count = 0;
   // Decrease priority due to QUANTUM consumition.
-  decreasepriority(myproc());
+  decreasepriority(p);
   // Add process to the priority table.
-  enqueue(myproc());
+  enqueue(p);
   sched();
 
-  release(&ptable.lock);
+  release(&p->rq->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -575,8 +936,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding the run queue lock from scheduler.
+  release(&myproc()->rq->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -604,10 +965,9 @@ sleep(void *chan, struct spinlock *lk)
     panic("sleep without lk");
 
   // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // change p->state. Once we hold ptable.lock,
+  // we can be guaranteed that we won't miss any
+  // wakeup (wakeup runs with ptable.lock locked),
   // so it's okay to release lk.
   if(lk != &ptable.lock){  //DOC: sleeplock0
     acquire(&ptable.lock);  //DOC: sleeplock1
@@ -616,33 +976,111 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  waitqadd(p);
+
+  // Hand over to the run queue lock to call sched.
+  // A wakeup that finds us SLEEPING has to take this
+  // lock to enqueue us, so it waits until we are off
+  // the cpu.
+  acquire(&p->rq->lock);
+  release(&ptable.lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->rq->lock);
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 //PAGEBREAK!
-// Wake up all processes sleeping on chan.
+// Returns the wait queue of the processes sleeping on chan.
+static struct waitqueue*
+waitqueue(void *chan)
+{
+  return &ptable.waitq[(((uint)chan * 2654435761U) >> 16) % NWAITQ];
+}
+
+// Appends a process going to sleep on p->chan to its wait queue.
 // The ptable lock must be held.
 static void
-wakeup1(void *chan)
+waitqadd(struct proc *p)
 {
-  struct proc *p;
+  struct waitqueue *q = waitqueue(p->chan);
+
+  p->wnext = 0;
+  if(q->last)
+    q->last->wnext = p;
+  else
+    q->head = p;
+  q->last = p;
+}
+
+// Removes a sleeping process from its wait queue.
+// The ptable lock must be held.
+static void
+waitqremove(struct proc *p)
+{
+  struct waitqueue *q = waitqueue(p->chan);
+  struct proc **pp, *prev = 0;
+
+  for(pp = &q->head; *pp; prev = *pp, pp = &(*pp)->wnext){
+    if(*pp == p){
+      *pp = p->wnext;
+      if(q->last == p)
+        q->last = prev;
+      p->wnext = 0;
+      return;
+    }
+  }
+}
+
+// Make a sleeping process RUNNABLE again.
+// The ptable lock must be held.
+static void
+wake(struct proc *p)
+{
+  acquire(&p->rq->lock);
+  increasepriority(p);
+  // Add process to the priority table.
+  enqueue(p);
+  release(&p->rq->lock);
+}
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan){
-      increasepriority(p);
-      // Add process to the priority table.
-      enqueue(p);
+// Wake up processes sleeping on chan, the ones that have been
+// waiting the longest first. Only the first one if one is set.
+// Just walks the wait queue of chan. The ptable lock must be held.
+static void
+wakechan(void *chan, int one)
+{
+  struct waitqueue *q = waitqueue(chan);
+  struct proc **pp, *p, *prev = 0;
+
+  pp = &q->head;
+  while((p = *pp) != 0){
+    if(p->chan != chan){
+      prev = p;
+      pp = &p->wnext;
+      continue;
     }
+    *pp = p->wnext;
+    if(q->last == p)
+      q->last = prev;
+    p->wnext = 0;
+    wake(p);
+    if(one)
+      return;
+  }
+}
+
+// Wake up all processes sleeping on chan.
+// The ptable lock must be held.
+static void
+wakeup1(void *chan)
+{
+  wakechan(chan, 0);
 }
 
 // Wake up all processes sleeping on chan.
@@ -654,6 +1092,29 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Wake up only the process that has been sleeping on chan
+// for the longest time. For exclusive waiters, where waking
+// all of them would just send the rest back to sleep.
+void
+wakeup_one(void *chan)
+{
+  acquire(&ptable.lock);
+  wakechan(chan, 1);
+  release(&ptable.lock);
+}
+
+// Wake up process p if it is sleeping on chan.
+void
+wakeupproc(struct proc *p, void *chan)
+{
+  acquire(&ptable.lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    waitqremove(p);
+    wake(p);
+  }
+  release(&ptable.lock);
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -663,14 +1124,50 @@ kill(int pid)
   struct proc *p;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = *pidchain(pid); p; p = p->hnext){
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
+      if(p->state == SLEEPING){
+        waitqremove(p);
+        acquire(&p->rq->lock);
         // Add process to the priority table.
         enqueue(p);
-        
+        release(&p->rq->lock);
+      }
+
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Copies to fs the page fault statistics of the process
+// with the given pid, or of all the cpus if pid is 0.
+// Returns -1 if there is no such process.
+int
+faultstat(int pid, struct faultstat *fs)
+{
+  struct proc *p;
+  int i, c;
+
+  if(pid == 0){
+    memset(fs, 0, sizeof(*fs));
+    for(c = 0; c < ncpu; c++){
+      for(i = 0; i < NPFCLASS; i++){
+        fs->count[i] += cpus[c].faults.count[i];
+        fs->cycles[i] += cpus[c].faults.cycles[i];
+      }
+    }
+    return 0;
+  }
+
+  acquire(&ptable.lock);
+  for(p = *pidchain(pid); p; p = p->hnext){
+    if(p->pid == pid){
+      *fs = p->faults;
       release(&ptable.lock);
       return 0;
     }
@@ -770,14 +1267,14 @@ procstat(void)
 	return 0;
 }
 
-// Prints a specified priority level of processes.
+// Prints a specified priority level of a run queue.
 // For debbuging purposes.
 void
-printlevel(int level)
+printlevel(struct runqueue *rq, int level)
 {
-  if(!isempty(level)){
+  if(!isempty(rq, level)){
     cprintf(" LEVEL %d: \n",level);
-    struct proc *p = levels[level].head;
+    struct proc *p = rq->levels[level].head;
     static char *states[] = {
     [UNUSED]    "unused  ",
     [EMBRYO]    "embryo  ",
@@ -802,24 +1299,34 @@ printlevel(int level)
 }
 
 // Print a list with the existent processes, their state and id.
-// Prints a list with the complete table of priority levels.
-// For debbuging purposes.
+// Prints a list with the complete table of priority levels
+// of every cpu. For debbuging purposes.
 void
 plevelstat(void)
 {
+  struct runqueue *rq;
+
   cprintf("\n----------- BEGIN: List processes ----------\n\n");
   // Acquire lock to keep data consistency while printing.
   acquire(&ptable.lock);
   // Print all processes.
   procstat();
 
-  cprintf("\n ===========  Priority table  ===========\n");
-  // Print each priority level.
-  for(int i = 0; i < PLEVELS; i++){
-    cprintf("\n");
-    printlevel(i);
+  for(rq = runqueues; rq < &runqueues[ncpu]; rq++){
+    cprintf("\n ===========  Priority table cpu %d  ===========\n", rq - runqueues);
+    acquire(&rq->lock);
+    // Print each non-empty priority level.
+    if(!rq->bitmap)
+      cprintf("\n EMPTY\n");
+    for(int i = 0; i < PLEVELS; i++){
+      if(isempty(rq, i))
+        continue;
+      cprintf("\n");
+      printlevel(rq, i);
+    }
+    release(&rq->lock);
   }
 
   release(&ptable.lock);
   cprintf("\n----------- END: List processes ----------\n");
-}
\ No newline at end of file
+}
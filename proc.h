@@ -1,3 +1,5 @@
+#include "pgfault.h"
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,6 +10,12 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct runqueue *rq;         // Priority levels of this cpu (see proc.c)
+  volatile uint halted;        // Is the cpu halted waiting for work?
+  uint idleticks;              // Clock ticks spent halted
+  uint64 idletsc;              // Halted time not yet accounted in idleticks
+  uint timerticks;             // Clock ticks the timer is armed for
+  struct faultstat faults;     // Page faults handled on this cpu
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,6 +42,25 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Part of a program segment that is read from the executable
+// one page at a time, the first time the page is touched.
+struct vmseg {
+  uint va;                     // Start of the segment, page aligned
+  uint off;                    // Offset of the segment in the executable
+  uint filesz;                 // Bytes of the segment in the executable
+};
+
+#define NVMSEG 4
+
+// A part of a file mapped with mmap() (see mmap.c).
+struct vmmap {
+  struct inode *ip;            // Mapped file, 0 if unused
+  uint va;                     // Start of the mapping, page aligned
+  uint off;                    // Offset of the mapping in the file
+  uint len;                    // Bytes mapped
+  int prot;                    // PROT_READ, PROT_WRITE
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -54,8 +81,22 @@ struct proc {
   uint age;                    // Age of this process
   int semids[PROCMAXSEM];      // Array of semaphores's id used by this process.
   int semcount;                // Amount of semaphores in use by this process.
+  int shmids[PROCMAXSHM];      // Shared memory segments held, -1 if none
+  uint shmva[PROCMAXSHM];      // Address each segment is mapped at, 0 if not
+  struct vmmap mmaps[PROCMAXMMAP]; // Mapped files
   struct proc *next;           // Next process with higher priority than this on the same level
   struct proc *back;           // Previous process with lower priority than this on the same level
+  struct runqueue *rq;         // Run queue of the cpu this process is enqueued at or running on
+  uint deadline;               // Tick to wake up at when sleeping in sys_sleep
+  struct proc *tnext;          // Next process on the same timer wheel slot
+  struct proc *wnext;          // Next process on the same wait queue
+  struct proc *hnext;          // Next process on the same pid hash chain or free list
+  struct proc *children;       // Most recently forked child
+  struct proc *sibling;        // Next child of the same parent
+  struct inode *exe;           // Executable the segments are read from
+  struct vmseg seg[NVMSEG];    // Segments of exe (see pagein() in vm.c)
+  int nseg;                    // Amount of segments
+  struct faultstat faults;     // Page faults of this process
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -210,13 +210,12 @@ semdown(int key)
 }
 
 // Increments the value of semaphore with id key by 1 and wakes up
-// all processes waiting for it.
+// the process that has been waiting for it the longest.
 // Returns 0 in case of success, EINVAL in case of invalid key.
 int
 semup(int key)
 {
   struct semaphore * s;
-  int semvalue;
 
   acquire(&sems.lock);
   // If invalid key.
@@ -226,15 +225,13 @@ semup(int key)
   }
 
   s = &sems.list[key];
-  semvalue = s->value;
   // Increase value.
   s->value++;
   release(&sems.lock);
-  
-  if(semvalue == 0){
-    // Wake up all processes sleeping on the semaphore s.
-    wakeup(s);
-  }
+
+  // Each up lets exactly one sleeping process through, so
+  // wake up one of them for every up, not just on 0 -> 1.
+  wakeup_one(s);
   return 0;
 }
 
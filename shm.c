@@ -0,0 +1,283 @@
+// Shared memory segments.
+//
+// A segment is a set of physical pages that every process holding
+// it can map at the same address: the slot the segment has in the
+// process's list, above SHMBASE. Segments are inherited by fork(),
+// kept (unmapped) across exec() and given back on exit(). A segment
+// is freed when the last process holding it lets it go.
+//
+// The segment holds one reference to each of its pages, and every
+// mapping of a page holds another one, so a page is freed when it
+// is neither in a segment nor mapped anywhere (see deallocuvm()).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "shm.h"
+
+#define SHMSLOT  ((KERNBASE - SHMBASE) / PROCMAXSHM)  // Room for a segment
+#define SHMMAXPAGES  (SHMSLOT / PGSIZE)
+
+struct {
+  struct shm list[SYSMAXSHM];          // System list of segments.
+  struct spinlock lock;
+} shms;
+
+// Initializes segments's lock.
+void
+shminit(void)
+{
+  initlock(&shms.lock, "shms");
+}
+
+// Address the segment in slot i of a process is mapped at.
+static uint
+slotva(int i)
+{
+  return SHMBASE + i*SHMSLOT;
+}
+
+// Gives the pages of the segment back. Must be called with
+// shms locked, once the segment has no references left.
+static void
+shmdestroy(struct shm *s)
+{
+  char *v;
+  int i;
+
+  for(i = 0; i < s->npages; i++){
+    v = P2V(s->pages[i]);
+    if(decref(v) == 0)
+      kfree(v);
+  }
+  kfree((char*)s->pages);
+  s->pages = 0;
+  s->npages = 0;
+}
+
+// Drops a reference to the segment with id shmid.
+static void
+shmput(int shmid)
+{
+  struct shm *s = &shms.list[shmid];
+
+  acquire(&shms.lock);
+  if(--s->references == 0)
+    shmdestroy(s);
+  release(&shms.lock);
+}
+
+// Creates a new segment of npages zeroed pages and returns
+// its id, or an error number.
+// Must be called with shms locked.
+static int
+shmcreate(int npages)
+{
+  struct shm *s;
+  char *mem;
+
+  for(s = shms.list; s < &shms.list[SYSMAXSHM]; s++)
+    if(s->references == 0)
+      break;
+  if(s == &shms.list[SYSMAXSHM])
+    return ENSHMSYS;
+
+  if((s->pages = (uint*)kalloc()) == 0)
+    return ENOMEM;
+  for(s->npages = 0; s->npages < npages; s->npages++){
+    if((mem = kalloc_zeroed()) == 0){
+      shmdestroy(s);
+      return ENOMEM;
+    }
+    s->pages[s->npages] = V2P(mem);
+  }
+  s->references = 1;
+  return s - shms.list;
+}
+
+// Maps the segment with id shmid in slot i of process p.
+// Returns -1 if out of memory.
+static int
+shmmap(struct proc *p, int i, int shmid)
+{
+  struct shm *s = &shms.list[shmid];
+  uint va;
+  int j;
+
+  va = slotva(i);
+  for(j = 0; j < s->npages; j++){
+    if(mappages(p->pgdir, (char*)va + j*PGSIZE, PGSIZE,
+                s->pages[j], PTE_W|PTE_U) < 0){
+      deallocuvm(p->pgdir, va + j*PGSIZE, va);
+      return -1;
+    }
+    incref(P2V(s->pages[j]));
+  }
+  p->shmva[i] = va;
+  return 0;
+}
+
+// If key == -1 creates a new segment of size bytes and returns its id.
+// Otherwise returns the id of the segment with that key.
+// Either way the current process holds the segment from now on.
+// In case of errors the next values are returned:
+// EINVAL: If there isn't a segment with that key, or bad size.
+// ENSHM: Too many segments in use by this process.
+// ENSHMSYS: Too many segments in use on the system.
+// ENOMEM: Not enough memory for the segment.
+int
+shmget(int key, int size)
+{
+  struct proc *p = myproc();
+  int i, shmid;
+
+  // Already held.
+  for(i = 0; i < PROCMAXSHM; i++)
+    if(key >= 0 && p->shmids[i] == key)
+      return key;
+
+  // Find a free slot in the process.
+  for(i = 0; i < PROCMAXSHM; i++)
+    if(p->shmids[i] == -1)
+      break;
+  if(i == PROCMAXSHM)
+    return ENSHM;
+
+  acquire(&shms.lock);
+  if(key == -1){
+    if(size <= 0 || size > SHMMAXPAGES*PGSIZE){
+      release(&shms.lock);
+      return EINVAL;
+    }
+    shmid = shmcreate(PGROUNDUP(size) / PGSIZE);
+  } else if(key < 0 || key >= SYSMAXSHM || shms.list[key].references == 0){
+    shmid = EINVAL;
+  } else {
+    shms.list[key].references++;
+    shmid = key;
+  }
+  release(&shms.lock);
+
+  if(shmid >= 0){
+    p->shmids[i] = shmid;
+    p->shmva[i] = 0;
+  }
+  return shmid;
+}
+
+// Maps the segment with id shmid, held by the current process,
+// into its address space. Returns the address it is mapped at,
+// or -1 if the process doesn't hold it or is out of memory.
+int
+shmat(int shmid)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for(i = 0; i < PROCMAXSHM; i++){
+    if(shmid >= 0 && p->shmids[i] == shmid){
+      if(p->shmva[i] == 0 && shmmap(p, i, shmid) < 0)
+        return -1;
+      return p->shmva[i];
+    }
+  }
+  return -1;
+}
+
+// Unmaps the segment mapped at va and lets it go.
+// Returns 0 in case of success, -1 if there isn't one.
+int
+shmdt(uint va)
+{
+  struct proc *p = myproc();
+  struct shm *s;
+  int i;
+
+  for(i = 0; i < PROCMAXSHM; i++){
+    if(p->shmids[i] != -1 && p->shmva[i] != 0 && p->shmva[i] == va){
+      s = &shms.list[p->shmids[i]];
+      deallocuvm(p->pgdir, va + s->npages*PGSIZE, va);
+      flushtlb();
+      shmput(p->shmids[i]);
+      p->shmids[i] = -1;
+      p->shmva[i] = 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Returns 1 if va to va+n lies in a segment mapped by p.
+int
+shmrange(struct proc *p, uint va, uint n)
+{
+  int i, shmid;
+
+  for(i = 0; i < PROCMAXSHM; i++){
+    shmid = p->shmids[i];
+    if(shmid != -1 && p->shmva[i] != 0 && va >= p->shmva[i] &&
+       va + n >= va && va + n <= p->shmva[i] + shms.list[shmid].npages*PGSIZE)
+      return 1;
+  }
+  return 0;
+}
+
+// Gives the child the segments of the parent, mapped at
+// the same addresses. Returns -1 if out of memory, with
+// the child holding no segments.
+int
+shmcopy(struct proc *parent, struct proc *child)
+{
+  int i, shmid;
+
+  for(i = 0; i < PROCMAXSHM; i++){
+    shmid = parent->shmids[i];
+    child->shmids[i] = shmid;
+    child->shmva[i] = 0;
+    if(shmid == -1)
+      continue;
+    acquire(&shms.lock);
+    shms.list[shmid].references++;
+    release(&shms.lock);
+    if(parent->shmva[i] != 0 && shmmap(child, i, shmid) < 0){
+      // The mappings made so far go away with the child's pgdir.
+      for(; i >= 0; i--){
+        if(child->shmids[i] != -1)
+          shmput(child->shmids[i]);
+        child->shmids[i] = -1;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// The segments stay held across exec(), but the
+// new address space doesn't map them.
+void
+shmexec(struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < PROCMAXSHM; i++)
+    p->shmva[i] = 0;
+}
+
+// Lets go of all the segments of the process. The pages stay
+// mapped until its page table is freed.
+void
+shmexit(struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < PROCMAXSHM; i++){
+    if(p->shmids[i] != -1)
+      shmput(p->shmids[i]);
+    p->shmids[i] = -1;
+    p->shmva[i] = 0;
+  }
+}
@@ -0,0 +1,11 @@
+// Error numbers.
+#define EINVAL    -2  // There isn't a segment with that key.
+#define ENSHM     -3  // Too many segments in use by this process.
+#define ENSHMSYS  -4  // Too many segments in use on the system.
+#define ENOMEM    -5  // Not enough memory for the segment.
+
+struct shm {
+  int npages;       // Size of the segment in pages
+  int references;   // Processes holding the segment
+  uint *pages;      // Physical address of each page
+};
@@ -0,0 +1,267 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of a single size. Objects are carved
+// out of slabs: pages from kalloc() that start with a struct slab
+// followed by as many objects as fit. Each object is followed by
+// a link word used while it is free, so the object itself keeps
+// the state its constructor gave it across frees and allocations.
+//
+// Each cpu keeps up to SLABMAG free objects of every cache, so
+// most allocations and frees only need pushcli(). The cache lock
+// is taken to move SLABBATCH objects at once between a cpu and
+// the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "slab.h"
+
+#define SLABMAG    16      // Max free objects cached by a cpu
+#define SLABBATCH   8      // Objects moved at once to/from the slabs
+
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  void *free;              // Free objects, linked through their link word
+  uint inuse;              // Objects given out of this slab
+};
+
+struct slabcpu {
+  void *objs[SLABMAG];
+  int n;
+  uint nalloc;             // Statistics
+  uint nfree;
+} __attribute__((aligned(64)));
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;               // Size of the objects
+  uint stride;             // Size of the objects plus their link word
+  uint perslab;            // Objects in a slab
+  void (*ctor)(void*);     // Initializes the objects of a new slab
+  struct slab partial;     // Slabs with free objects
+  struct slab full;        // Slabs without free objects
+  uint nslabs;
+  uint inuse;              // Objects given out of the slabs
+  uint ngrow;              // Statistics
+  uint nshrink;
+  struct slabcpu cpu[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kcache caches[NKCACHE];
+  int n;
+} kcaches;
+
+void
+slabinit(void)
+{
+  initlock(&kcaches.lock, "kcaches");
+}
+
+// Link word of the object obj of cache c.
+#define OBJLINK(c, obj) (*(void**)((char*)(obj) + (c)->size))
+
+static void
+slabadd(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+static void
+slabremove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+// Creates a cache of objects of the given size. ctor, if not 0,
+// is called on every object once, when its slab is allocated.
+// Objects should be given back to the cache in the same state.
+struct kcache*
+kcachecreate(char *name, uint size, void (*ctor)(void*))
+{
+  struct kcache *c;
+
+  size = (size + 3) & ~3;
+  if(size == 0 || sizeof(struct slab) + size + sizeof(void*) > PGSIZE)
+    panic("kcachecreate: size");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n == NKCACHE)
+    panic("kcachecreate: too many caches");
+  c = &kcaches.caches[kcaches.n++];
+  release(&kcaches.lock);
+
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->stride = size + sizeof(void*);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->stride;
+  c->ctor = ctor;
+  c->partial.next = c->partial.prev = &c->partial;
+  c->full.next = c->full.prev = &c->full;
+  return c;
+}
+
+// Allocates and constructs a new slab for c.
+// Called with c->lock held.
+static struct slab*
+grow(struct kcache *c)
+{
+  struct slab *s;
+  char *obj;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    obj = (char*)(s + 1) + i * c->stride;
+    if(c->ctor)
+      c->ctor(obj);
+    OBJLINK(c, obj) = s->free;
+    s->free = obj;
+  }
+  slabadd(&c->partial, s);
+  c->nslabs++;
+  c->ngrow++;
+  return s;
+}
+
+// Takes an object out of the slabs of c.
+// Called with c->lock held.
+static void*
+slaballoc(struct kcache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  s = c->partial.next;
+  if(s == &c->partial && (s = grow(c)) == 0)
+    return 0;
+  obj = s->free;
+  s->free = OBJLINK(c, obj);
+  s->inuse++;
+  c->inuse++;
+  if(s->free == 0){
+    slabremove(s);
+    slabadd(&c->full, s);
+  }
+  return obj;
+}
+
+// Puts the object back in its slab, and gives the slab
+// back to kalloc() once it is unused, unless it is the
+// last slab with free objects of the cache.
+// Called with c->lock held.
+static void
+slabfree(struct kcache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->free == 0){
+    slabremove(s);
+    slabadd(&c->partial, s);
+  }
+  OBJLINK(c, obj) = s->free;
+  s->free = obj;
+  s->inuse--;
+  c->inuse--;
+  if(s->inuse == 0 && (c->partial.next != s || s->next != &c->partial)){
+    slabremove(s);
+    kfree((char*)s);
+    c->nslabs--;
+    c->nshrink++;
+  }
+}
+
+// Allocates a constructed object of cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kcachealloc(struct kcache *c)
+{
+  struct slabcpu *sc;
+  void *obj;
+
+  pushcli();
+  sc = &c->cpu[cpuid()];
+  if(sc->n == 0){
+    acquire(&c->lock);
+    while(sc->n < SLABBATCH && (obj = slaballoc(c)) != 0)
+      sc->objs[sc->n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(sc->n > 0){
+    obj = sc->objs[--sc->n];
+    sc->nalloc++;
+  }
+  popcli();
+  return obj;
+}
+
+// Gives back an object allocated from cache c.
+void
+kcachefree(struct kcache *c, void *obj)
+{
+  struct slabcpu *sc;
+  int i;
+
+  pushcli();
+  sc = &c->cpu[cpuid()];
+  if(sc->n == SLABMAG){
+    acquire(&c->lock);
+    for(i = 0; i < SLABBATCH; i++)
+      slabfree(c, sc->objs[--sc->n]);
+    release(&c->lock);
+  }
+  sc->objs[sc->n++] = obj;
+  sc->nfree++;
+  popcli();
+}
+
+// Copies the statistics of up to n caches to st.
+// Returns the number of caches copied.
+int
+slabstat(struct slabstat *st, int n)
+{
+  struct kcache *c;
+  int i, k;
+
+  acquire(&kcaches.lock);
+  if(n > kcaches.n)
+    n = kcaches.n;
+  release(&kcaches.lock);
+  for(k = 0; k < n; k++, st++){
+    c = &kcaches.caches[k];
+    memset(st, 0, sizeof(*st));
+    safestrcpy(st->name, c->name, sizeof(st->name));
+    for(i = 0; i < ncpu; i++){
+      st->nalloc += c->cpu[i].nalloc;
+      st->nfree += c->cpu[i].nfree;
+      st->cached += c->cpu[i].n;
+    }
+    acquire(&c->lock);
+    st->size = c->size;
+    st->perslab = c->perslab;
+    st->nslabs = c->nslabs;
+    st->inuse = c->inuse - st->cached;
+    st->ngrow = c->ngrow;
+    st->nshrink = c->nshrink;
+    release(&c->lock);
+  }
+  return n;
+}
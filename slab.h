@@ -0,0 +1,15 @@
+// Statistics of a kernel object cache, see slabstat() in slab.c.
+#define NKCACHE    16      // Max amount of caches
+
+struct slabstat {
+  char name[16];
+  uint size;               // Size of the objects
+  uint perslab;            // Objects in a slab
+  uint nslabs;             // Slabs in use
+  uint inuse;              // Objects given out
+  uint cached;             // Free objects cached by the cpus
+  uint nalloc;             // Allocations and frees
+  uint nfree;
+  uint ngrow;              // Slabs allocated and released
+  uint nshrink;
+};
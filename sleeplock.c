@@ -37,7 +37,8 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  // Only one of the waiters can get the lock.
+  wakeup_one(lk);
   release(&lk->lk);
 }
 
@@ -21,6 +21,8 @@ fetchint(uint addr, int *ip)
 
   if(addr >= curproc->sz || addr+4 > curproc->sz)
     return -1;
+  if(touchuvm(addr, 4) < 0)
+    return -1;
   *ip = *(int*)(addr);
   return 0;
 }
@@ -39,6 +41,8 @@ fetchstr(uint addr, char **pp)
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && touchuvm((uint)s, 1) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -63,12 +67,31 @@ argptr(int n, char **pp, int size)
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0)
+    return -1;
+  if(((uint)i >= curproc->sz || (uint)i+size > curproc->sz) &&
+     !shmrange(curproc, i, size) && !mmaprange(curproc, i, size))
+    return -1;
+  // The kernel may use the block with spinlocks held,
+  // so page it in now.
+  if(touchuvm(i, size) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Like argptr, for a block the kernel is going to write to:
+// it must not lie in a read-only file mapping.
+int
+argoutptr(int n, char **pp, int size)
+{
+  if(argptr(n, pp, size) < 0)
+    return -1;
+  if(!mmapwritable(myproc(), (uint)*pp))
+    return -1;
+  return 0;
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -110,6 +133,15 @@ extern int sys_semget(void);
 extern int sys_semfree(void);
 extern int sys_semdown(void);
 extern int sys_semup(void);
+extern int sys_idleticks(void);
+extern int sys_slabstat(void);
+extern int sys_faultstat(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_bcachestat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]       sys_fork,
@@ -140,6 +172,15 @@ static int (*syscalls[])(void) = {
 [SYS_semfree]    sys_semfree,
 [SYS_semdown]    sys_semdown,
 [SYS_semup]      sys_semup,
+[SYS_idleticks]  sys_idleticks,
+[SYS_slabstat]   sys_slabstat,
+[SYS_faultstat]  sys_faultstat,
+[SYS_shmget]     sys_shmget,
+[SYS_shmat]      sys_shmat,
+[SYS_shmdt]      sys_shmdt,
+[SYS_mmap]       sys_mmap,
+[SYS_munmap]     sys_munmap,
+[SYS_bcachestat] sys_bcachestat,
 };
 
 void
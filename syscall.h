@@ -27,3 +27,12 @@
 #define SYS_semfree    26
 #define SYS_semdown    27
 #define SYS_semup      28
+#define SYS_idleticks  29
+#define SYS_slabstat   30
+#define SYS_faultstat  31
+#define SYS_shmget     32
+#define SYS_shmat      33
+#define SYS_shmdt      34
+#define SYS_mmap       35
+#define SYS_munmap     36
+#define SYS_bcachestat 37
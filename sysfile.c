@@ -73,7 +73,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argoutptr(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -109,7 +109,7 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argoutptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -314,6 +314,12 @@ sys_open(void)
       return -1;
     }
   }
+  // A program being run cannot be written to.
+  if(ip->nexec > 0 && (omode & (O_WRONLY|O_RDWR))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
 
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
@@ -427,7 +433,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argoutptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
@@ -443,3 +449,25 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+int
+sys_mmap(void)
+{
+  struct file *f;
+  int off, len, prot;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &len) < 0 ||
+     argint(3, &prot) < 0)
+    return -1;
+  return mmap(f, off, len, prot);
+}
+
+int
+sys_munmap(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return munmap((uint)addr);
+}
@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "bcache.h"
+#include "slab.h"
 
 int
 sys_fork(void)
@@ -65,13 +67,18 @@ sys_sleep(void)
   if(argint(0, &n) < 0)
     return -1;
   acquire(&tickslock);
+  clockupdate();
   ticks0 = ticks;
   while(ticks - ticks0 < n){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    timeradd(myproc(), ticks0 + n);
+    timerarm();
+    sleep(&myproc()->deadline, &tickslock);
+    // Woken up before the deadline if killed.
+    timerdel(myproc());
   }
   release(&tickslock);
   return 0;
@@ -85,6 +92,7 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
+  clockupdate();
   xticks = ticks;
   release(&tickslock);
   return xticks;
@@ -159,4 +167,86 @@ sys_semup(void)
   // Get argument.
   argint(0, &key);
   return semup(key);
-}
\ No newline at end of file
+}
+
+// Returns the amount of clock ticks the given cpu
+// spent halted waiting for work.
+int
+sys_idleticks(void)
+{
+  int cpu;
+
+  if(argint(0, &cpu) < 0)
+    return -1;
+  return idleticks(cpu);
+}
+
+// Copies the statistics of up to n kernel object caches
+// to user memory. Returns the number of caches copied.
+int
+sys_slabstat(void)
+{
+  struct slabstat *st;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NKCACHE)
+    return -1;
+  if(argoutptr(0, (void*)&st, n*sizeof(*st)) < 0)
+    return -1;
+  return slabstat(st, n);
+}
+
+// Copies the statistics of the buffer cache to user memory.
+int
+sys_bcachestat(void)
+{
+  struct bcachestat *st;
+
+  if(argoutptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  bcachestat(st);
+  return 0;
+}
+
+// Copies the page fault statistics of a process, or
+// of the whole system if pid is 0, to user memory.
+int
+sys_faultstat(void)
+{
+  int pid;
+  struct faultstat *fs;
+
+  if(argint(0, &pid) < 0 || argoutptr(1, (void*)&fs, sizeof(*fs)) < 0)
+    return -1;
+  return faultstat(pid, fs);
+}
+
+int
+sys_shmget(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmget(key, size);
+}
+
+int
+sys_shmat(void)
+{
+  int shmid;
+
+  if(argint(0, &shmid) < 0)
+    return -1;
+  return shmat(shmid);
+}
+
+int
+sys_shmdt(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shmdt((uint)addr);
+}
@@ -14,6 +14,15 @@ extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 uint aging_ticks = 0; // Number of ticks occured since last aging.
+uint balance_ticks = 0; // Number of ticks occured since last rebalance.
+uint nextwakeup = 0; // Tick of the earliest sys_sleep wakeup, 0 if none.
+uint64 ticktsc; // Time-stamp counter value at the last tick.
+
+// Timer wheel of the processes sleeping in sys_sleep. A process
+// with deadline d is kept on slot d % NTIMERSLOTS, and each tick
+// only looks at its own slot. Protected by tickslock.
+#define NTIMERSLOTS 64
+struct proc *timerwheel[NTIMERSLOTS];
 
 void
 tvinit(void)
@@ -25,6 +34,134 @@ tvinit(void)
   SETGATE(idt[T_SYSCALL], 1, SEG_KCODE<<3, vectors[T_SYSCALL], DPL_USER);
 
   initlock(&tickslock, "time");
+  ticktsc = rdtsc();
+}
+
+// Must be called with tickslock held. Adds p to the timer
+// wheel, to be woken up at tick deadline.
+void
+timeradd(struct proc *p, uint deadline)
+{
+  struct proc **slot = &timerwheel[deadline % NTIMERSLOTS];
+
+  p->deadline = deadline;
+  p->tnext = *slot;
+  *slot = p;
+  // Make sure some cpu takes a timer interrupt in time.
+  if(!nextwakeup || (int)(deadline - nextwakeup) < 0)
+    nextwakeup = deadline;
+}
+
+// Must be called with tickslock held. Removes p from the
+// timer wheel if it is still there.
+void
+timerdel(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &timerwheel[p->deadline % NTIMERSLOTS]; *pp; pp = &(*pp)->tnext){
+    if(*pp == p){
+      *pp = p->tnext;
+      p->tnext = 0;
+      return;
+    }
+  }
+}
+
+// Must be called with tickslock held. Wakes up the processes
+// whose deadline is the current tick.
+static void
+timerexpire(void)
+{
+  struct proc **pp, *p;
+  int i, n;
+
+  pp = &timerwheel[ticks % NTIMERSLOTS];
+  while((p = *pp) != 0){
+    if(p->deadline != ticks){
+      pp = &p->tnext;
+      continue;
+    }
+    *pp = p->tnext;
+    p->tnext = 0;
+    wakeupproc(p, &p->deadline);
+  }
+
+  if(!nextwakeup || (int)(nextwakeup - ticks) > 0)
+    return;
+
+  // Find the next earliest deadline.
+  nextwakeup = 0;
+  for(i = 0; i < NTIMERSLOTS; i++){
+    for(p = timerwheel[i]; p; p = p->tnext){
+      n = p->deadline - ticks;
+      if(n > 0 && (!nextwakeup || n < (int)(nextwakeup - ticks)))
+        nextwakeup = p->deadline;
+    }
+  }
+}
+
+// Must be called with tickslock held. Brings ticks up to
+// date with the time-stamp counter, doing the periodic work
+// of every tick elapsed since the last call. Any cpu taking a
+// timer interrupt keeps the clock, so it does not stop when
+// some cpus skip ticks.
+void
+clockupdate(void)
+{
+  uint64 now = rdtsc();
+
+  if(tsctick == 0)
+    return;
+
+  while(now - ticktsc >= tsctick){
+    ticktsc += tsctick;
+    ticks++;
+
+    if(++aging_ticks >= AGINGSTEP){
+      // Perform aging and prioritize those process that exeeds the age limit.
+      aging();
+      // Reset aging ticks.
+      aging_ticks = 0;
+    }
+
+    if(++balance_ticks >= BALANCESTEP){
+      // Spread RUNNABLE processes among the cpus.
+      rebalance();
+      // Reset balance ticks.
+      balance_ticks = 0;
+    }
+
+    // Wake up the sleepers whose time has come.
+    timerexpire();
+  }
+}
+
+// Programs the timer of this cpu for its next interrupt.
+// A cpu with processes waiting in its run queue takes an
+// interrupt every tick. Otherwise nothing needs it before the
+// first of: the end of the quantum of the running process, the
+// next aging and the earliest sys_sleep wakeup.
+// Must be called with interrupts disabled.
+void
+timerarm(void)
+{
+  struct cpu *c = mycpu();
+  int n;
+
+  if(cpuload() > 0)
+    n = 1;
+  else {
+    n = AGINGSTEP - aging_ticks;
+    if(c->proc && QUANTUM - (int)c->proc->ticks_count < n)
+      n = QUANTUM - c->proc->ticks_count;
+    if(nextwakeup && (int)(nextwakeup - ticks) < n)
+      n = nextwakeup - ticks;
+    if(n < 1)
+      n = 1;
+  }
+  c->timerticks = n;
+  lapictimer(n);
 }
 
 void
@@ -47,31 +184,30 @@ trap(struct trapframe *tf)
     return;
   }
 
-  if (tf->trapno == T_PGFLT)
-  {
-    myproc()->tf = tf;
-    handlepgflt();
-    // handler call
+  // Demand paging and copy-on-write. Other page faults
+  // are handled as any unexpected trap below.
+  if(tf->trapno == T_PGFLT && myproc() && handlepgflt(tf) == 0){
+    if(myproc()->killed && (tf->cs&3) == DPL_USER)
+      exit();
     return;
   }
-  
 
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
+    // Unlocked peek, only take the lock if a tick is due.
+    if(rdtsc() - ticktsc >= tsctick){
       acquire(&tickslock);
-      ticks++;
-
-      if(++aging_ticks >= AGINGSTEP){
-        // Perform aging and prioritize those process that exeeds the age limit.
-        aging();
-        // Reset aging ticks.
-        aging_ticks = 0;
-      }
-      
-      wakeup(&ticks);
+      clockupdate();
       release(&tickslock);
     }
+    // The running process used the ticks the timer was armed for.
+    if(myproc() && myproc()->state == RUNNING)
+      myproc()->ticks_count += mycpu()->timerticks;
+    timerarm();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // Only needed to get a halted cpu out of hlt.
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -121,7 +257,7 @@ trap(struct trapframe *tf)
 	// Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING && tf->trapno == T_IRQ0+IRQ_TIMER){
-		if (++myproc()->ticks_count >= QUANTUM)
+		if (myproc()->ticks_count >= QUANTUM)
 			yield();
 	}
 
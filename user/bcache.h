@@ -0,0 +1 @@
+../bcache.h
\ No newline at end of file
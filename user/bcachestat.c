@@ -0,0 +1,39 @@
+// Prints the statistics of the buffer cache: lookups and
+// evictions of each class of blocks, and how many of the
+// cached blocks were used more than once.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "bcache.h"
+
+char *classes[NBCLASS] = {
+[BC_DATA]   "data",
+[BC_INODE]  "inode",
+[BC_BITMAP] "bitmap",
+[BC_LOG]    "log",
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct bcachestat st;
+  uint n;
+  int i;
+
+  if(bcachestat(&st) < 0){
+    printf(2, "bcachestat: failed\n");
+    exit();
+  }
+  printf(1, "class\thits\tmisses\tevicted\thit %%\n");
+  for(i = 0; i < NBCLASS; i++){
+    n = st.hits[i] + st.misses[i];
+    printf(1, "%s\t%d\t%d\t%d\t%d\n", classes[i], st.hits[i], st.misses[i],
+           st.evictions[i], n ? st.hits[i] * 100 / n : 0);
+  }
+  printf(1, "%d buffers: %d hot, %d cold, %d unused; %d ghost hits\n",
+         st.nbuf, st.nhot, st.ncold, st.nbuf - st.nhot - st.ncold,
+         st.ghosthits);
+  printf(1, "%d blocks read ahead\n", st.readaheads);
+  exit();
+}
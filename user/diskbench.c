@@ -0,0 +1,104 @@
+// Disk throughput benchmark. Reads every file of the root
+// directory, which comes from the disk right after boot, then
+// writes a large file a few times. For each phase it prints
+// the throughput and the cpu time spent per megabyte, summed
+// over all cpus from the idle ticks each one counts.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "fs.h"
+
+#define FILESIZE  (64*1024)
+#define NWRITES   8
+
+char buf[8192];
+
+// Ticks all the cpus spent idle so far.
+int
+idle(void)
+{
+  int cpu, n, t;
+
+  n = 0;
+  for(cpu = 0; (t = idleticks(cpu)) >= 0; cpu++)
+    n += t;
+  return n;
+}
+
+int
+ncpus(void)
+{
+  int cpu;
+
+  for(cpu = 0; idleticks(cpu) >= 0; cpu++)
+    ;
+  return cpu;
+}
+
+void
+report(char *what, int kb, int start, int idle0)
+{
+  int elapsed, busy;
+
+  elapsed = uptime() - start;
+  busy = elapsed * ncpus() - (idle() - idle0);
+  if(elapsed == 0)
+    elapsed = 1;
+  if(kb == 0)
+    kb = 1;
+  printf(1, "%s: %d KB in %d ticks, %d KB/tick, %d cpu ticks/MB\n",
+         what, kb, elapsed, kb / elapsed, busy * 1024 / kb);
+}
+
+int
+readall(void)
+{
+  struct dirent de;
+  int dir, fd, n, kb;
+  char name[DIRSIZ+1];
+
+  kb = 0;
+  if((dir = open(".", O_RDONLY)) < 0)
+    return 0;
+  while(read(dir, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    memmove(name, de.name, DIRSIZ);
+    name[DIRSIZ] = 0;
+    if((fd = open(name, O_RDONLY)) < 0)
+      continue;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      kb += n;
+    close(fd);
+  }
+  close(dir);
+  return kb / 1024;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, n, start, idle0;
+
+  start = uptime();
+  idle0 = idle();
+  report("read", readall(), start, idle0);
+
+  memset(buf, 'x', sizeof(buf));
+  start = uptime();
+  idle0 = idle();
+  for(i = 0; i < NWRITES; i++){
+    if((fd = open("diskbench.tmp", O_CREATE|O_RDWR)) < 0){
+      printf(2, "diskbench: cannot create file\n");
+      exit();
+    }
+    for(n = 0; n < FILESIZE; n += sizeof(buf))
+      write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  report("write", NWRITES * FILESIZE / 1024, start, idle0);
+  unlink("diskbench.tmp");
+  exit();
+}
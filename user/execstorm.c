@@ -0,0 +1,52 @@
+// Fork/exec/exit benchmark. Runs a few workers side by side,
+// each forking children that exec this program again and exit
+// right away, to keep the page allocator busy on every cpu.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define WORKERS  4
+#define ROUNDS 100
+
+int
+main(int argc, char *argv[])
+{
+  char *args[] = { "execstorm", "child", 0 };
+  int i, r, pid, workers, start;
+
+  if(argc > 1 && strcmp(argv[1], "child") == 0)
+    exit();
+
+  workers = WORKERS;
+  if(argc > 1 && atoi(argv[1]) > 0)
+    workers = atoi(argv[1]);
+
+  start = uptime();
+  for(i = 0; i < workers; i++){
+    if((pid = fork()) < 0){
+      printf(1, "execstorm: fork failed\n");
+      break;
+    }
+    if(pid == 0){
+      for(r = 0; r < ROUNDS; r++){
+        if((pid = fork()) < 0){
+          printf(1, "execstorm: fork failed\n");
+          exit();
+        }
+        if(pid == 0){
+          exec(args[0], args);
+          printf(1, "execstorm: exec failed\n");
+          exit();
+        }
+        wait();
+      }
+      exit();
+    }
+  }
+  for(; i > 0; i--)
+    wait();
+  printf(1, "execstorm: %d fork/exec/exit in %d ticks\n",
+         workers * ROUNDS, uptime() - start);
+  exit();
+}
@@ -0,0 +1,46 @@
+// Prints the page fault statistics of the whole system,
+// or of the process with the given pid.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pgfault.h"
+
+char *classes[NPFCLASS] = {
+[PF_COWCOPY]  "cow copy",
+[PF_COWREUSE] "cow reuse",
+[PF_ZERO]     "zero fill",
+[PF_FILE]     "file",
+[PF_INVALID]  "invalid",
+};
+
+// Average of c cycles over n faults, without 64-bit division.
+uint
+average(uint64 c, uint n)
+{
+  if(n == 0)
+    return 0;
+  if((c >> 32) == 0)
+    return (uint)c / n;
+  return (uint)(c >> 10) / n << 10;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct faultstat fs;
+  int i, pid;
+
+  pid = 0;
+  if(argc > 1)
+    pid = atoi(argv[1]);
+  if(faultstat(pid, &fs) < 0){
+    printf(2, "faultstat: no process %d\n", pid);
+    exit();
+  }
+  printf(1, "class\t\tfaults\tavg cycles\n");
+  for(i = 0; i < NPFCLASS; i++)
+    printf(1, "%s\t%d\t%d\n", classes[i], fs.count[i],
+           average(fs.cycles[i], fs.count[i]));
+  exit();
+}
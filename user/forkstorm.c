@@ -0,0 +1,56 @@
+// Fork/exit storm benchmark. Fills the process table with
+// sleeping processes and then measures how long bursts of
+// fork, exit and wait take with all of them around.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define SLEEPERS  800
+#define ROUNDS     50
+#define BURST      20
+
+int pids[SLEEPERS];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, r, pid, sleepers, start;
+
+  sleepers = SLEEPERS;
+  if(argc > 1 && atoi(argv[1]) < SLEEPERS)
+    sleepers = atoi(argv[1]);
+
+  for(n = 0; n < sleepers; n++){
+    if((pid = fork()) < 0)
+      break;
+    if(pid == 0){
+      sleep(1000000);
+      exit();
+    }
+    pids[n] = pid;
+  }
+  printf(1, "forkstorm: %d sleeping processes\n", n);
+
+  start = uptime();
+  for(r = 0; r < ROUNDS; r++){
+    for(i = 0; i < BURST; i++){
+      if((pid = fork()) < 0){
+        printf(1, "forkstorm: fork failed\n");
+        break;
+      }
+      if(pid == 0)
+        exit();
+    }
+    for(; i > 0; i--)
+      wait();
+  }
+  printf(1, "forkstorm: %d fork/exit/wait in %d ticks\n",
+         ROUNDS * BURST, uptime() - start);
+
+  for(i = 0; i < n; i++)
+    kill(pids[i]);
+  for(i = 0; i < n; i++)
+    wait();
+  exit();
+}
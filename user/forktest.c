@@ -6,7 +6,7 @@
 #include "stat.h"
 #include "user.h"
 
-#define N  1000
+#define N  2000
 
 void
 printf(int fd, const char *s, ...)
@@ -0,0 +1,110 @@
+// Tests that memory is given to a process on demand: sbrk() only
+// reserves it, and the pages of the program are read from the
+// executable when first touched.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "pgfault.h"
+
+#define PGSIZE   4096
+#define HEAPSZ   (8*1024*1024)
+#define NTOUCH   4
+
+void
+fail(char *what)
+{
+  printf(1, "lazytest: %s FAILED\n", what);
+  exit();
+}
+
+void
+getstat(struct faultstat *fs)
+{
+  if(faultstat(getpid(), fs) < 0)
+    fail("faultstat");
+}
+
+// A big sbrk() only maps the pages that are touched.
+void
+sbrktest(void)
+{
+  struct faultstat before, after;
+  char *p;
+  uint n;
+  int i;
+
+  getstat(&before);
+  if((p = sbrk(HEAPSZ)) == (char*)-1)
+    fail("sbrk");
+  for(i = 0; i < NTOUCH; i++)
+    p[i * (HEAPSZ / NTOUCH)] = i;
+  p[HEAPSZ-1] = 'z';
+  getstat(&after);
+
+  for(i = 0; i < NTOUCH; i++)
+    if(p[i * (HEAPSZ / NTOUCH)] != i)
+      fail("heap contents");
+  if(p[HEAPSZ-1] != 'z' || p[HEAPSZ-2] != 0)
+    fail("last byte of the heap");
+
+  // One zero filled page per page touched; the first one
+  // may have been mapped already, if the heap ended in it.
+  n = after.count[PF_ZERO] - before.count[PF_ZERO];
+  if(n < NTOUCH || n > NTOUCH + 1){
+    printf(1, "lazytest: %d pages zero filled for %d touched\n", n, NTOUCH + 1);
+    fail("lazy sbrk");
+  }
+  if(sbrk(-HEAPSZ) == (char*)-1)
+    fail("sbrk shrink");
+  printf(1, "lazy sbrk ok\n");
+}
+
+// Touching memory past the end of the heap kills the process
+// rather than giving it a zero filled page.
+void
+pastsztest(void)
+{
+  char *top;
+  int fds[2];
+  char c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(fds[0]);
+    top = (char*)(((uint)sbrk(0) + PGSIZE - 1) & ~(PGSIZE - 1));
+    c = top[PGSIZE];
+    write(fds[1], &c, 1);
+    exit();
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 0)
+    fail("access past sz");
+  close(fds[0]);
+  wait();
+  printf(1, "access past sz ok\n");
+}
+
+// The pages of the program were read from the executable
+// when it touched them.
+void
+exectest(void)
+{
+  struct faultstat fs;
+
+  getstat(&fs);
+  if(fs.count[PF_FILE] == 0)
+    fail("exec paging");
+  printf(1, "exec paging ok, %d pages read\n", fs.count[PF_FILE]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  exectest();
+  sbrktest();
+  pastsztest();
+  printf(1, "lazytest ok\n");
+  exit();
+}
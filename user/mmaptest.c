@@ -0,0 +1,230 @@
+// Tests of file mappings: sharing of the pages of a file,
+// private copies of writable mappings, read-only mappings
+// refused as read() buffers, and munmap().
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "bcache.h"
+
+#define PGSIZE   4096
+#define FILESZ   (2*PGSIZE)
+
+char *name = "mmapfile";
+char buf[PGSIZE];
+
+void
+fail(char *what)
+{
+  printf(1, "mmaptest: %s FAILED\n", what);
+  unlink(name);
+  exit();
+}
+
+// Runs f in a child, and returns 1 if it got to
+// the end, 0 if it was killed on the way.
+int
+survives(void (*f)(void))
+{
+  int fds[2];
+  char c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(fds[0]);
+    f();
+    write(fds[1], "y", 1);
+    exit();
+  }
+  close(fds[1]);
+  c = 0;
+  read(fds[0], &c, 1);
+  close(fds[0]);
+  wait();
+  return c == 'y';
+}
+
+// Opens the test file, failing the test if it can't.
+int
+openfile(int mode)
+{
+  int fd;
+
+  if((fd = open(name, mode)) < 0)
+    fail("open");
+  return fd;
+}
+
+// Maps the whole test file.
+char*
+mapfile(int fd, int prot)
+{
+  char *p;
+
+  if((p = mmap(fd, 0, FILESZ, prot)) == (char*)-1)
+    fail("mmap");
+  return p;
+}
+
+void
+makefile(void)
+{
+  int fd, i;
+
+  memset(buf, 'a', sizeof(buf));
+  fd = openfile(O_CREATE|O_RDWR);
+  for(i = 0; i < FILESZ; i += sizeof(buf))
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+      fail("write");
+  close(fd);
+}
+
+// Data blocks looked up in the buffer cache so far.
+uint
+datalookups(void)
+{
+  struct bcachestat st;
+
+  if(bcachestat(&st) < 0)
+    fail("bcachestat");
+  return st.hits[BC_DATA] + st.misses[BC_DATA];
+}
+
+// Two processes mapping the same file share its pages: the second
+// one to touch a page does not read it again. Writing to the file
+// drops the pages, and later mappings see the new contents.
+void
+sharetest(void)
+{
+  int fd, up[2], down[2];
+  uint n;
+  char *p, c;
+
+  fd = openfile(O_RDONLY);
+  p = mapfile(fd, PROT_READ);
+  if(pipe(up) < 0 || pipe(down) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(up[0]);
+    close(down[1]);
+    c = p[PGSIZE];
+    write(up[1], &c, 1);
+    // Keep the page mapped until the parent is done.
+    read(down[0], &c, 1);
+    exit();
+  }
+  close(up[1]);
+  close(down[0]);
+  if(read(up[0], &c, 1) != 1 || c != 'a')
+    fail("child reads mapping");
+  n = datalookups();
+  c = p[PGSIZE];
+  if(datalookups() != n)
+    fail("pages shared");
+  if(c != 'a')
+    fail("parent reads mapping");
+  close(down[1]);
+  close(up[0]);
+  wait();
+  munmap(p);
+  close(fd);
+
+  fd = openfile(O_WRONLY);
+  if(write(fd, "b", 1) != 1)
+    fail("write");
+  close(fd);
+  fd = openfile(O_RDONLY);
+  p = mapfile(fd, PROT_READ);
+  if(p[0] != 'b')
+    fail("mapping sees file writes");
+  munmap(p);
+  close(fd);
+  printf(1, "mmap share ok\n");
+}
+
+// Writing to a writable mapping gives the process its own copy:
+// neither the file nor other mappings of it change.
+void
+cowtest(void)
+{
+  int fd, rfd;
+  char *p, *q, c;
+
+  fd = openfile(O_RDWR);
+  p = mapfile(fd, PROT_READ|PROT_WRITE);
+  q = mapfile(fd, PROT_READ);
+  c = p[PGSIZE];
+  p[PGSIZE] = 'w';
+  if(p[PGSIZE] != 'w')
+    fail("write to writable mapping");
+  if(q[PGSIZE] != c)
+    fail("other mapping unchanged");
+  munmap(p);
+  munmap(q);
+  close(fd);
+
+  rfd = openfile(O_RDONLY);
+  if(read(rfd, buf, PGSIZE) != PGSIZE || read(rfd, &c, 1) != 1)
+    fail("read");
+  if(c != 'a')
+    fail("file unchanged");
+  close(rfd);
+  printf(1, "mmap copy on write ok\n");
+}
+
+// read() into a read-only mapping fails instead of writing to it.
+void
+readonlytest(void)
+{
+  int fd;
+  char *p;
+
+  fd = openfile(O_RDONLY);
+  p = mapfile(fd, PROT_READ);
+  if(read(fd, p, 16) != -1)
+    fail("read into read-only mapping");
+  if(p[0] != 'b')
+    fail("read-only mapping unchanged");
+  munmap(p);
+  close(fd);
+  printf(1, "mmap read-only ok\n");
+}
+
+void
+touchunmapped(void)
+{
+  volatile char *p;
+  int fd;
+
+  fd = openfile(O_RDONLY);
+  p = mapfile(fd, PROT_READ);
+  if(p[0] != 'b')
+    fail("mapping contents");
+  if(munmap((char*)p) < 0)
+    fail("munmap");
+  p[0];
+}
+
+// Touching a mapping after munmap() faults.
+void
+munmaptest(void)
+{
+  if(survives(touchunmapped))
+    fail("access after munmap");
+  printf(1, "mmap unmap ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  makefile();
+  sharetest();
+  cowtest();
+  readonlytest();
+  munmaptest();
+  unlink(name);
+  printf(1, "mmaptest ok\n");
+  exit();
+}
@@ -0,0 +1 @@
+../pgfault.h
\ No newline at end of file
@@ -1,23 +1,33 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
-#include "fcntl.h"
 
 #define BUFFER_SIZE 70
 
 int lk;
 int empty;
 int full;
-int fd;
+struct ring {
+  int head;
+  int tail;
+  int count;
+  int items[BUFFER_SIZE];
+} *ring;
 int number;
 
 void initialize()
 {
+  int shmid;
+
+  // The ring lives in a shared memory segment,
+  // inherited by the child on fork().
+  if((shmid = shmget(-1, sizeof(*ring))) < 0 ||
+     (ring = shmat(shmid)) == (void*)-1){
+    printf(1, "ERROR: shmget \n");
+    exit();
+  }
+  ring->head = ring->tail = ring->count = 0;
   number = 0;
-  if ((fd = open("buffer", O_RDWR)) < 0)
-    fd = open("buffer", O_CREATE);
-  write(fd, &number, sizeof(number));
-	close(fd);
 }
 
 void
@@ -26,17 +36,11 @@ enqueue()
   if(semdown(lk) < 0)
     printf(1, "ERROR: semdown lk enqueue \n");
 
-  fd = open("buffer", O_RDWR);
-  read(fd, &number, sizeof(number));
-  close(fd);
-
-	number++;
-
-  fd = open("buffer", O_RDWR);
-	write(fd, &number, sizeof(number));
-	close(fd);
+  ring->items[ring->tail] = ++number;
+  ring->tail = (ring->tail + 1) % BUFFER_SIZE;
+  ring->count++;
 
-  printf(1, "PRODUCER:    %d \n", number);
+  printf(1, "PRODUCER:    %d \n", ring->count);
 
   if(semup(lk) < 0)
     printf(1, "ERROR: semup lk enqueue \n");
@@ -45,20 +49,16 @@ enqueue()
 void
 dequeue()
 {
+  int item;
+
   if(semdown(lk) < 0)
     printf(1, "ERROR: semdown lk dequeue \n");
 
-  fd = open("buffer", O_RDWR);
-  read(fd, &number, sizeof(number));
-  close(fd);
-
-	number--;
-
-  fd = open("buffer", O_RDWR);
-	write(fd, &number, sizeof(number));
-	close(fd);
+  item = ring->items[ring->head];
+  ring->head = (ring->head + 1) % BUFFER_SIZE;
+  ring->count--;
 
-  printf(1, "CONSUMER:         %d \n", number);
+  printf(1, "CONSUMER:         %d (item %d) \n", ring->count, item);
 
   if(semup(lk) < 0)
     printf(1, "ERROR: semup lk dequeue \n");
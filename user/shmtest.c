@@ -0,0 +1,215 @@
+// Tests of shared memory segments: sharing after fork(),
+// unmapping with shmdt(), holding them across exec(), and
+// giving their pages back once nobody holds them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define PGSIZE   4096
+#define BIGSZ    (4*1024*1024)  // Largest segment
+#define NBIG     64             // More than fits in memory at once
+
+void
+fail(char *what)
+{
+  printf(1, "shmtest: %s FAILED\n", what);
+  exit();
+}
+
+// Runs f in a child, and returns 1 if it got to
+// the end, 0 if it was killed on the way.
+int
+survives(void (*f)(int), int arg)
+{
+  int fds[2];
+  char c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(fds[0]);
+    f(arg);
+    write(fds[1], "y", 1);
+    exit();
+  }
+  close(fds[1]);
+  c = 0;
+  read(fds[0], &c, 1);
+  close(fds[0]);
+  wait();
+  return c == 'y';
+}
+
+// A segment attached before fork() is shared with the child.
+void
+forktest(void)
+{
+  volatile char *p;
+  int id;
+
+  if((id = shmget(-1, PGSIZE)) < 0)
+    fail("shmget");
+  if((p = shmat(id)) == (char*)-1)
+    fail("shmat");
+  p[0] = 'p';
+  if(fork() == 0){
+    if(p[0] != 'p')
+      fail("child sees parent's write");
+    if(shmget(id, 0) != id || shmat(id) != p)
+      fail("child holds the segment");
+    p[1] = 'c';
+    exit();
+  }
+  wait();
+  if(p[1] != 'c')
+    fail("parent sees child's write");
+  if(shmdt((void*)p) < 0)
+    fail("shmdt");
+  printf(1, "shm fork ok\n");
+}
+
+void
+touchdetached(int unused)
+{
+  volatile char *p;
+  int id;
+
+  if((id = shmget(-1, PGSIZE)) < 0 || (p = shmat(id)) == (char*)-1)
+    fail("shmget");
+  p[0] = 1;
+  if(shmdt((void*)p) < 0)
+    fail("shmdt");
+  p[0] = 2;
+}
+
+// Touching a segment after shmdt() faults.
+void
+detachtest(void)
+{
+  if(survives(touchdetached, 0))
+    fail("access after shmdt");
+  printf(1, "shm detach ok\n");
+}
+
+// Writes n in decimal to buf.
+void
+itoa(uint n, char *buf)
+{
+  char tmp[16];
+  int i;
+
+  i = 0;
+  do {
+    tmp[i++] = '0' + n % 10;
+    n /= 10;
+  } while(n > 0);
+  while(i > 0)
+    *buf++ = tmp[--i];
+  *buf = 0;
+}
+
+void
+touchunattached(int va)
+{
+  volatile char *p;
+
+  p = (char*)va;
+  p[0] = 0;
+}
+
+// Run by exectest() after exec(): the segment id is still
+// held, but not mapped at va until it is attached again.
+void
+afterexec(int id, int va, int fd)
+{
+  char *p;
+
+  if(survives(touchunattached, va))
+    fail("segment mapped after exec");
+  if((p = shmat(id)) != (char*)va)
+    fail("segment held after exec");
+  if(p[0] != 'e')
+    fail("segment contents after exec");
+  write(fd, "y", 1);
+  exit();
+}
+
+// A segment stays held across exec(), without a mapping.
+void
+exectest(void)
+{
+  char *p, *argv[6], ids[16], vas[16], fds[16], c;
+  int id, fd[2];
+
+  if((id = shmget(-1, PGSIZE)) < 0 || (p = shmat(id)) == (char*)-1)
+    fail("shmget");
+  p[0] = 'e';
+  if(pipe(fd) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(fd[0]);
+    itoa(id, ids);
+    itoa((uint)p, vas);
+    itoa(fd[1], fds);
+    argv[0] = "shmtest";
+    argv[1] = "afterexec";
+    argv[2] = ids;
+    argv[3] = vas;
+    argv[4] = fds;
+    argv[5] = 0;
+    exec("shmtest", argv);
+    fail("exec");
+  }
+  close(fd[1]);
+  c = 0;
+  read(fd[0], &c, 1);
+  close(fd[0]);
+  wait();
+  if(c != 'y')
+    fail("shm exec");
+  shmdt(p);
+  printf(1, "shm exec ok\n");
+}
+
+void
+bigsegment(int unused)
+{
+  char *p;
+  int id, i;
+
+  if((id = shmget(-1, BIGSZ)) < 0)
+    fail("shmget big segment");
+  if((p = shmat(id)) == (char*)-1)
+    fail("shmat big segment");
+  for(i = 0; i < BIGSZ; i += PGSIZE)
+    p[i] = 1;
+}
+
+// The pages of a segment are freed when the last process
+// holding it exits: creating more segments than fit in
+// memory, one after the other, always works.
+void
+freetest(void)
+{
+  int i;
+
+  for(i = 0; i < NBIG; i++)
+    if(!survives(bigsegment, 0))
+      fail("segment memory given back");
+  printf(1, "shm free ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 5 && strcmp(argv[1], "afterexec") == 0)
+    afterexec(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+
+  forktest();
+  detachtest();
+  exectest();
+  freetest();
+  printf(1, "shmtest ok\n");
+  exit();
+}
@@ -0,0 +1 @@
+../slab.h
\ No newline at end of file
@@ -0,0 +1,28 @@
+// Prints the statistics of the kernel object caches: object size,
+// objects per slab, slabs in use, objects in use, objects cached
+// by the cpus, allocations and frees, and slabs allocated and
+// released.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "slab.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct slabstat st[NKCACHE];
+  int i, n;
+
+  if((n = slabstat(st, NKCACHE)) < 0){
+    printf(2, "slabstat: failed\n");
+    exit();
+  }
+  printf(1, "cache\tsize\tperslab\tslabs\tinuse\tcached\tallocs\tfrees\tgrows\tshrinks\n");
+  for(i = 0; i < n; i++)
+    printf(1, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", st[i].name,
+           st[i].size, st[i].perslab, st[i].nslabs, st[i].inuse,
+           st[i].cached, st[i].nalloc, st[i].nfree, st[i].ngrow,
+           st[i].nshrink);
+  exit();
+}
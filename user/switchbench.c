@@ -0,0 +1,49 @@
+// Context switch latency benchmark. A parent and a child
+// bounce a byte over a pair of pipes, so that every round
+// trip is two switches between address spaces. Boot with
+// CPUS=1 to measure switches rather than cross-cpu wakeups.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define ROUNDS 20000
+
+int
+main(int argc, char *argv[])
+{
+  int ping[2], pong[2], i, rounds, start;
+  char c;
+
+  rounds = ROUNDS;
+  if(argc > 1 && atoi(argv[1]) > 0)
+    rounds = atoi(argv[1]);
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf(2, "switchbench: pipe failed\n");
+    exit();
+  }
+  start = uptime();
+  switch(fork()){
+  case -1:
+    printf(2, "switchbench: fork failed\n");
+    exit();
+  case 0:
+    for(i = 0; i < rounds; i++){
+      if(read(ping[0], &c, 1) != 1)
+        break;
+      write(pong[1], &c, 1);
+    }
+    exit();
+  }
+  c = 0;
+  for(i = 0; i < rounds; i++){
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1)
+      break;
+  }
+  wait();
+  printf(1, "switchbench: %d round trips in %d ticks\n",
+         i, uptime() - start);
+  exit();
+}
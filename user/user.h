@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct faultstat;
+struct bcachestat;
+struct slabstat;
 
 // system calls
 int fork(void);
@@ -30,6 +33,15 @@ int semget(int key, int init_value);
 int semfree(int key);
 int semdown(int key);
 int semup(int key);
+int idleticks(int cpu);
+int slabstat(struct slabstat*, int);
+int faultstat(int pid, struct faultstat*);
+int shmget(int key, int size);
+void* shmat(int shmid);
+int shmdt(void* addr);
+void* mmap(int fd, int off, int len, int prot);
+int munmap(void* addr);
+int bcachestat(struct bcachestat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -6,6 +6,9 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "fcntl.h"
+
+#define INVLPGMAX 32  // Pages cowuvm() invalidates one by one before flushing all
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -42,10 +45,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -57,7 +59,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -79,6 +81,37 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Like mappages(), but maps the 4MB aligned parts of the range
+// with 4MB pages (PTE_PS), straight from the page directory.
+// Used for the kernel mappings, so that a page directory needs
+// few page tables for them.
+static int
+mapbigpages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
+{
+  uint a, n;
+
+  a = (uint)va;
+  while(size > 0){
+    if(a % BIGPGSIZE == 0 && pa % BIGPGSIZE == 0 && size >= BIGPGSIZE){
+      if(pgdir[PDX(a)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(a)] = pa | perm | PTE_P | PTE_PS;
+      n = BIGPGSIZE;
+    } else {
+      // Small pages up to the next 4MB boundary.
+      n = BIGPGSIZE - a % BIGPGSIZE;
+      if(n > size)
+        n = size;
+      if(mappages(pgdir, (void*)a, n, pa, perm) < 0)
+        return -1;
+    }
+    a += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -101,46 +134,51 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 // (directly addressable from end..P2V(PHYSTOP)).
 
 // This table defines the kernel's mappings, which are present in
-// every process's page table.
+// every process's page table. They are global (PTE_G), so they
+// stay in the TLB when switching page tables.
 static struct kmap {
   void *virt;
   uint phys_start;
   uint phys_end;
   int perm;
 } kmap[] = {
- { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
- { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
- { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
+ { (void*)KERNBASE, 0,             EXTMEM,    PTE_W|PTE_G}, // I/O space
+ { (void*)KERNLINK, V2P(KERNLINK), V2P(data), PTE_G},       // kern text+rodata
+ { (void*)data,     V2P(data),     PHYSTOP,   PTE_W|PTE_G}, // kern data+memory
+ { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W|PTE_G}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Set up kernel part of a page table. The kernel part is the
+// same in every page table, so the page tables of kpgdir are
+// shared by all of them and never freed.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, with the kernel mappings
+// that setupkvm() gives to every process.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kalloc_zeroed()) == 0)
+    panic("kvmalloc");
+  if (P2V(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mapbigpages(kpgdir, k->virt, k->phys_end - k->phys_start,
+                (uint)k->phys_start, k->perm) < 0)
+      panic("kvmalloc");
   switchkvm();
 }
 
@@ -149,7 +187,8 @@ kvmalloc(void)
 void
 switchkvm(void)
 {
-  lcr3(V2P(kpgdir));   // switch to the kernel page table
+  if(rcr3() != V2P(kpgdir))
+    lcr3(V2P(kpgdir));   // switch to the kernel page table
 }
 
 // Switch TSS and h/w page table to correspond to process p.
@@ -173,7 +212,10 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // Switch to process's address space, unless it is still
+  // loaded from the last time it ran (see scheduler()).
+  if(rcr3() != V2P(p->pgdir))
+    lcr3(V2P(p->pgdir));
   popcli();
 }
 
@@ -186,31 +228,141 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
+// Map the page at user address va of process p, below p->sz
+// but never touched before. Pages of the program segments are
+// read from the executable, the rest (bss, heap) are zero filled.
+// pte is the entry for va if its page table exists, 0 otherwise.
+// Reading the executable sleeps, so it is only done if cansleep.
+// Returns PF_FILE or PF_ZERO, or -1 if the page could not be mapped.
+static int
+pagein(struct proc *p, uint va, pte_t *pte, int cansleep)
+{
+  struct vmseg *s;
+  char *mem;
+  uint off, n;
+
+  va = PGROUNDDOWN(va);
+  off = n = 0;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    if(va >= s->va && va - s->va < s->filesz){
+      off = s->off + (va - s->va);
+      n = s->filesz - (va - s->va);
+      if(n > PGSIZE)
+        n = PGSIZE;
+      break;
+    }
+  }
+  if(n > 0 && !cansleep)
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(n > 0){
+    ilock(p->exe);
+    if(readi(p->exe, mem, off, n) != n){
+      iunlock(p->exe);
+      kfree(mem);
+      return -1;
+    }
+    iunlock(p->exe);
+  }
+  if(pte)
+    *pte = V2P(mem) | PTE_P | PTE_W | PTE_U;
+  else if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return n > 0 ? PF_FILE : PF_ZERO;
+}
+
+static int cowfault(uint, pte_t*);
+
+// Maps the page at va of a file mapping of p (see mmap.c),
+// read-only: every mapping of a page of a file shares it.
+// A write to a writable mapping gives p its own copy. A write to
+// a read-only mapping is invalid, even by the kernel on behalf of
+// p; system calls check for it first (see argoutptr()), so that
+// e.g. read() into a read-only mapping fails. pte is the entry
+// of va, if its page table exists, and err the error code of
+// the fault.
+static int
+mmapin(struct proc *p, uint va, pte_t *pte, uint err, int cansleep)
+{
+  struct vmmap *m;
+  char *v;
+  int write;
+
+  if((m = mmapfind(p, va)) == 0)
+    return -1;
+  write = err & FEC_WR;
+  if(write && !(m->prot & PROT_WRITE))
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(pte && (*pte & PTE_P)){
+    if(write && !(*pte & PTE_W))
+      return cowfault(va, pte);
+    return -1;
+  }
+  if(!cansleep || (v = filepage(m->ip, m->off + (va - m->va))) == 0)
+    return -1;
+  if(pte)
+    *pte = V2P(v) | PTE_P | PTE_U;
+  else if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(v), PTE_U) < 0){
+    if(decref(v) == 0)
+      kfree(v);
+    return -1;
+  }
+  if(write && cowfault(va, walkpgdir(p->pgdir, (char*)va, 0)) < 0)
+    return -1;
+  return PF_FILE;
+}
+
+// Adds a fault of the given class, handled since the
+// TSC was tsc0, to the statistics of p and of this cpu.
+static void
+countfault(struct proc *p, int class, uint64 tsc0)
+{
+  uint64 t;
+
+  t = rdtsc() - tsc0;
+  p->faults.count[class]++;
+  p->faults.cycles[class] += t;
+  pushcli();
+  mycpu()->faults.count[class]++;
+  mycpu()->faults.cycles[class] += t;
+  popcli();
+}
+
+// Map the never touched pages from va to va+n of the current
+// process, so that the kernel can use them without faulting,
+// e.g. while holding a spinlock. va to va+n must be below sz
+// or in a file mapping.
+// Returns -1 if some page could not be mapped.
 int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+touchuvm(uint va, uint n)
 {
-  uint i, pa, n;
+  struct proc *p = myproc();
+  uint64 tsc0;
   pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
+  uint a;
+  int class;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P))
+      continue;
+    tsc0 = rdtsc();
+    if(a < p->sz)
+      class = pagein(p, a, pte, 1);
     else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
+      class = mmapin(p, a, pte, 0, 1);
+    countfault(p, class < 0 ? PF_INVALID : class, tsc0);
+    if(class < 0)
       return -1;
   }
   return 0;
@@ -231,13 +383,12 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -271,11 +422,9 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       if(pa == 0)
         panic("kfree");
       char *v = P2V(pa);
-      
-      if(refcount(v) == 1)
+
+      if(decref(v) == 0)
         kfree(v);
-      else
-        decref(v);
 
       *pte = 0;
     }
@@ -284,7 +433,7 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part. The kernel part is shared, see setupkvm().
 void
 freevm(pde_t *pgdir)
 {
@@ -293,7 +442,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -356,33 +505,82 @@ flushtlb()
   lcr3(V2P(myproc()->pgdir));
 }
 
+// Map the pages of pgdir already present from va to va+n into
+// npgdir, read-only in both, to be copied on write. Returns -1
+// if out of memory; the pages shared so far stay mapped.
+int
+shareuvm(pde_t *pgdir, pde_t *npgdir, uint va, uint n)
+{
+  pte_t *pte;
+  uint a;
+  int wp, r;
+
+  wp = r = 0;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if((pte = walkpgdir(pgdir, (char*)a, 0)) == 0 || !(*pte & PTE_P))
+      continue;
+    if(*pte & PTE_W){
+      *pte &= ~PTE_W;
+      wp = 1;
+    }
+    if(mappages(npgdir, (char*)a, PGSIZE, PTE_ADDR(*pte), PTE_U) < 0){
+      r = -1;
+      break;
+    }
+    incref(P2V(PTE_ADDR(*pte)));
+  }
+  if(wp)
+    flushtlb();
+  return r;
+}
+
 // Given a parent process's page table, maps the parent
-// pages into the child.
+// pages into the child. Works one page table page at a time:
+// the child gets a copy of each of the parent's page tables,
+// both read-only, and the shared pages get their references
+// bumped in the same pass. pgdir must be the current page table.
 pde_t*
 cowuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
+  pte_t *pgtab, *npgtab;
+  uint a, j, n, nwp;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    // Clear Write Bit
-    *pte &= ~PTE_W;    
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    // Map parent page into child's
-    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+  nwp = 0;
+  for(a = 0; a < sz; a = PGADDR(PDX(a) + 1, 0, 0)){
+    // Nothing touched yet on this page table.
+    if(!(pgdir[PDX(a)] & PTE_P))
+      continue;
+    pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[PDX(a)]));
+    if((npgtab = (pte_t*)kalloc_zeroed()) == 0)
       goto bad;
 
-    incref(P2V(pa));
+    // Amount of pages below sz on this page table.
+    n = NPTENTRIES;
+    if(sz - a < PGSIZE*NPTENTRIES)
+      n = PGROUNDUP(sz - a) / PGSIZE;
+    for(j = 0; j < n; j++){
+      // The child will page it in by itself.
+      if(!(pgtab[j] & PTE_P))
+        continue;
+      // Clear Write Bit. Pages already shared are read-only,
+      // the TLB only needs to forget the ones that were not.
+      if(pgtab[j] & PTE_W){
+        pgtab[j] &= ~PTE_W;
+        if(++nwp <= INVLPGMAX)
+          invlpg((void*)(a + j*PGSIZE));
+      }
+      // Map parent page into child's
+      npgtab[j] = pgtab[j];
+      incref(P2V(PTE_ADDR(pgtab[j])));
+    }
+    d[PDX(a)] = V2P(npgtab) | PTE_P | PTE_W | PTE_U;
   }
-  flushtlb();
+  // Too many pages to invalidate one by one.
+  if(nwp > INVLPGMAX)
+    flushtlb();
   return d;
 
 bad:
@@ -405,50 +603,77 @@ uva2ka(pde_t *pgdir, char *uva)
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
-// Page Fault Handler: When a process tries to Write a read-only page due
-// to copy-on-write.
-void
-handlepgflt()
+// Gives the process its own writable copy of the copy-on-write
+// page at va. If nobody else shares the page anymore, it only
+// has to be made writable.
+// Returns PF_COWCOPY or PF_COWREUSE, or -1 if out of memory.
+static int
+cowfault(uint va, pte_t *pte)
 {
-  pte_t *pte;
-  char *mem;
-  uint faultaddr, flags, pa;
-  char *gfa;
+  char *mem, *v;
+  int class;
 
-  // Get the faulting virtual address.
-  faultaddr = rcr2();
-  // Get the start of the page.
-  gfa = (char*)PGROUNDDOWN((uint)faultaddr);
-  // If the faulty address is not user address kill the process.
-  if(faultaddr >= KERNBASE || (pte = walkpgdir(myproc()->pgdir, gfa, 0)) == 0)
-    goto kill;
-
-  pa = PTE_ADDR(*pte);
-  flags = PTE_FLAGS(*pte);
-  char *v = P2V(pa);
-
-  if(refcount(v) > 1){
+  v = P2V(PTE_ADDR(*pte));
+  if(refcount(v) == 1){
+    *pte |= PTE_W;
+    class = PF_COWREUSE;
+  } else {
     if((mem = kalloc()) == 0)
-      goto nomem;
+      return -1;
     memmove(mem, v, PGSIZE);
     // Make pte to point to the new allocated page.
-    *pte = V2P(mem) | flags | PTE_P | PTE_W;
-    decref(v);
+    *pte = V2P(mem) | PTE_FLAGS(*pte) | PTE_W;
+    // The other sharers may have left meanwhile.
+    if(decref(v) == 0)
+      kfree(v);
+    class = PF_COWCOPY;
   }
-  else
-    *pte |= PTE_W;
-    
-  flushtlb();
-  return;
-
-kill:
-  cprintf("pid %d %s: Page fault: Invalid Address.\n", myproc()->pid, myproc()->name);
-  myproc()->killed = 1;
-  return;
-nomem:
-  cprintf("pid %d %s: No memory available.\n", myproc()->pid, myproc()->name);
-  myproc()->killed = 1;
-  return;
+  // Only this entry changed, no need to flush the whole TLB.
+  invlpg((void*)va);
+  return class;
+}
+
+// Page fault handler. Classifies the fault (see pgfault.h):
+// writes to copy-on-write pages get a private copy, pages that
+// were never touched are mapped (see pagein()), anything else
+// is invalid. Counts the fault and the cycles spent on it in
+// the statistics of the process and of the cpu.
+// Returns -1 if the fault is invalid or could not be handled.
+int
+handlepgflt(struct trapframe *tf)
+{
+  struct proc *p = myproc();
+  uint64 tsc0;
+  pte_t *pte;
+  uint va;
+  int class;
+
+  tsc0 = rdtsc();
+  // Get the faulting virtual address.
+  va = rcr2();
+
+  class = PF_INVALID;
+  if(va < p->sz){
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    if(pte == 0 || !(*pte & PTE_P)){
+      // Reading the page from the executable sleeps, which is fine
+      // unless the faulting code had interrupts off (holds spinlocks).
+      if(tf->eflags & FL_IF)
+        sti();
+      class = pagein(p, va, pte, tf->eflags & FL_IF);
+    } else if((tf->err & FEC_WR) && (*pte & PTE_U) && !(*pte & PTE_W))
+      class = cowfault(va, pte);
+  } else if(va >= MMAPBASE && va < SHMBASE){
+    if(tf->eflags & FL_IF)
+      sti();
+    class = mmapin(p, va, walkpgdir(p->pgdir, (char*)va, 0),
+                   tf->err, tf->eflags & FL_IF);
+  }
+  if(class < 0)
+    class = PF_INVALID;
+
+  countfault(p, class, tsc0);
+  return class == PF_INVALID ? -1 : 0;
 }
 
 // Copy len bytes from p to user address va in page table pgdir.
@@ -30,6 +30,21 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -117,6 +132,15 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until the next one arrives.
+// sti only takes effect after the following instruction,
+// so no interrupt can slip in between the two.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt" : : : "memory");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -130,6 +154,35 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Index of the least significant set bit of val.
+// val must not be zero.
+static inline uint
+bsf(uint val)
+{
+  uint r;
+  asm volatile("bsf %1,%0" : "=r" (r) : "rm" (val) : "cc");
+  return r;
+}
+
+// Index of the most significant set bit of val.
+// val must not be zero.
+static inline uint
+bsr(uint val)
+{
+  uint r;
+  asm volatile("bsr %1,%0" : "=r" (r) : "rm" (val) : "cc");
+  return r;
+}
+
+// Read the time-stamp counter.
+static inline uint64
+rdtsc(void)
+{
+  uint64 val;
+  asm volatile("rdtsc" : "=A" (val));
+  return val;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +197,35 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
+static inline uint
+rcr4(void)
+{
+  uint val;
+  asm volatile("movl %%cr4,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr4(uint val)
+{
+  asm volatile("movl %0,%%cr4" : : "r" (val));
+}
+
+// Invalidate the TLB entry of the page at addr.
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().